@@ -0,0 +1,31 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <pthread.h>
+
+/*
+ * Fixação de threads em CPUs. Sem libnuma: a memória fica no nó NUMA da
+ * CPU porque o Linux aloca cada página no nó da thread que a toca primeiro
+ * (first-touch). Por isso as threads são fixadas já na criação, antes de
+ * tocarem a própria pilha e os buffers.
+ */
+
+/**
+ * Converte uma lista como "0-3,8,10-11" em números de CPU.
+ * @return quantidade de CPUs escritas em cpus (até max), -1 se a lista é inválida.
+ */
+int affinity_parse_cpus(const char *list, int *cpus, int max);
+
+/**
+ * Faz as threads criadas com attr começarem fixas em cpu.
+ * @return 0 se sucesso, -1 se erro.
+ */
+int affinity_attr_set(pthread_attr_t *attr, int cpu);
+
+/**
+ * Nó NUMA da CPU, lido de /sys/devices/system/cpu.
+ * @return número do nó ou -1 se desconhecido.
+ */
+int affinity_cpu_node(int cpu);
+
+#endif // AFFINITY_H
@@ -0,0 +1,12 @@
+#ifndef CACHELINE_H
+#define CACHELINE_H
+
+/*
+ * Alinhamento em linha de cache, para separar campos escritos por threads
+ * diferentes (evita false sharing). Objetos de tipos alinhados alocados no
+ * heap precisam de posix_memalign, não de malloc/calloc.
+ */
+#define CACHE_LINE 64
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE)))
+
+#endif // CACHELINE_H
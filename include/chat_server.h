@@ -2,39 +2,179 @@
 #define CHAT_SERVER_H
 
 #include "threadsafe_queue.h"
+#include "envelope.h"
+#include "timer_wheel.h"
+#include "cacheline.h"
 #include <pthread.h>
 #include <semaphore.h>
 
 #define CHAT_HISTORY_DEFAULT 100
+/* limite para o envio de uma mensagem inteira a um cliente (não por send
+ * parcial): um cliente travado não segura o broadcaster (nem o prazo do
+ * drain) indefinidamente */
+#define CHAT_SEND_TIMEOUT_MS 5000
+/* liveness: sem dados por idle_timeout/2 o servidor manda PING; sem dados
+ * por idle_timeout a conexão é derrubada e a vaga liberada */
+#define CHAT_IDLE_TIMEOUT_MS 60000
+#define CHAT_TICK_MS 100
 
+/*
+ * Estado de uma conexão. É alocado no heap (endereço estável mesmo quando
+ * clients[] é compactado) e tem contagem de referências: o array de
+ * clientes possui uma referência e quem envia fora do clients_mtx (ex.:
+ * mensagens privadas) adquire outra. O socket é fechado na última
+ * referência, evitando que um fd reaproveitado receba dados de outro.
+ */
+typedef struct ChatConn {
+    int fd;
+    int refs;
+    char *name;                   /* nullable; protegido por clients_mtx */
+    int echo;                     /* recebe as próprias mensagens no broadcast */
+    pthread_mutex_t send_mtx;     /* serializa writes no socket */
+    struct ChatConn *name_next;   /* encadeamento no índice de nomes */
+    char *pending;                /* linha incompleta guardada para handoff (clients_mtx) */
+    size_t pending_len;
+
+    /* liveness (ver reaper em chat_server.c). last_seen_ms é escrito a cada
+     * recv pela thread do cliente; fica em outra linha de cache para não
+     * invalidar fd/echo/send_mtx, lidos pelo broadcaster a cada envio */
+    long long last_seen_ms CACHE_ALIGNED; /* atualizado sem lock a cada recv */
+    long long pinged_at_ms;       /* last_seen de quando o último PING foi enviado */
+    tw_timer_t idle_timer;        /* protegido por wheel_mtx */
+    int removed;                  /* protegido por wheel_mtx */
+} ChatConn;
+
+/* chamado sob clients_mtx, na ordem das sequências, para cada mensagem local */
+typedef void (*chat_message_hook_t)(void *arg, unsigned long seq, const char *name, const char *text);
+
+/*
+ * Os grupos de campos usados por threads diferentes (clients_mtx e o que ele
+ * protege; o semáforo de vagas; a fila; drain; roda de timers) começam em
+ * linhas de cache próprias, evitando false sharing entre o broadcaster, as
+ * threads de cliente e o reaper.
+ */
 typedef struct {
-    pthread_mutex_t clients_mtx;
+    pthread_mutex_t clients_mtx CACHE_ALIGNED;
     int *clients; /* dynamic array */
     int num_clients;
     int max_clients;
-    sem_t slots;
-    message_queue_t mq;
+    sem_t slots CACHE_ALIGNED;
+    message_queue_t mq;           /* alinhada pelo próprio tipo */
 
-    /* history circular buffer */
-    char **history;
+    /* history circular buffer (envelopes compartilhados com a fila) */
+    envelope_t **history CACHE_ALIGNED;
     int history_size;
     int history_start;
     int history_count;
+    unsigned long next_seq; /* próximo número de sequência (protegido por clients_mtx) */
+
+    /* estado por conexão, paralelo a clients[] */
+    ChatConn **conns;
 
-    /* client names parallel to clients[] (nullable) */
-    char **client_names;
+    /* índice nome -> conexão (hash com encadeamento, protegido por clients_mtx) */
+    ChatConn **name_index;
+    int name_index_size;
 
     pthread_t broadcaster_tid;
+    int broadcaster_cpu;          /* CPU em que o broadcaster nasceu fixo, -1 = sem fixação */
     int running;
+
+    /* estado do drain: sinalizado quando o broadcaster termina ou um cliente sai */
+    pthread_mutex_t drain_mtx CACHE_ALIGNED;
+    pthread_cond_t drain_cond;
+    int broadcaster_done;
+    int broadcaster_joined;
+    long long drain_deadline_ms;  /* CLOCK_MONOTONIC; 0 = sem drain (atômico) */
+
+    /* detecção de conexões ociosas: uma roda de timers para todas as conexões */
+    timer_wheel_t wheel CACHE_ALIGNED;
+    pthread_mutex_t wheel_mtx;
+    pthread_cond_t reaper_cond;
+    pthread_t reaper_tid;
+    int idle_timeout_ms; /* 0 desliga */
+
+    /* encaminhamento das mensagens locais (modo cluster); NULL = desligado */
+    chat_message_hook_t message_hook;
+    void *message_hook_arg;
 } ChatServer;
 
-int chat_server_init(ChatServer *s, int max_clients, int history_size);
+/* broadcaster_cpu >= 0 cria o broadcaster já fixo nessa CPU (se ela não
+ * existir, ele roda sem fixação e s->broadcaster_cpu fica -1) */
+int chat_server_init(ChatServer *s, int max_clients, int history_size, int broadcaster_cpu);
 int chat_server_add_client(ChatServer *s, int client_fd);
+/* remove o cliente; o socket é fechado quando a última referência for liberada */
 void chat_server_remove_client(ChatServer *s, int client_fd);
 int chat_server_enqueue_message(ChatServer *s, const char *msg, int sender_fd);
+/* enfileira uma mensagem vinda de outro servidor (não passa pelo gancho) */
+int chat_server_enqueue_remote(ChatServer *s, const char *name, const char *msg);
+void chat_server_set_message_hook(ChatServer *s, chat_message_hook_t hook, void *arg);
 void chat_server_shutdown(ChatServer *s);
+/*
+ * Encerramento gracioso: fecha a fila para novas mensagens e espera o
+ * broadcaster entregar o que já estava enfileirado. Se disconnect_clients,
+ * faz SHUT_WR em cada cliente (o kernel envia o restante do buffer e o FIN)
+ * e espera que desconectem. Tudo limitado por timeout_ms, mais no máximo
+ * CHAT_SEND_TIMEOUT_MS de um envio já em curso quando o prazo vence (o
+ * broadcaster confere o prazo antes de cada envio e desiste dos restantes).
+ * Retorna 0 se drenou dentro do prazo, -1 se o prazo estourou.
+ * Deve ser seguido de chat_server_shutdown.
+ */
+int chat_server_drain(ChatServer *s, int timeout_ms, int disconnect_clients);
+/*
+ * Volta a servir depois de um chat_server_drain sem desconexão (handoff que
+ * não se completou): reabre a fila e recria o broadcaster. Sem drain
+ * anterior não faz nada. Retorna 0 ou -1 em erro.
+ */
+int chat_server_resume(ChatServer *s);
+/*
+ * Copia os fds, nomes e linhas incompletas (ver chat_server_save_pending)
+ * dos clientes conectados (para handoff). Os arrays são alocados aqui; nomes
+ * e pendentes são cópias (nullable) que o chamador libera. Retorna o número
+ * de clientes ou -1 em erro.
+ */
+int chat_server_export_clients(ChatServer *s, int **out_fds, char ***out_names,
+                               char ***out_pending, size_t **out_pending_len,
+                               unsigned long *out_next_seq);
+/* guarda os bytes de uma linha ainda sem '\n' lidos do cliente, para que o
+ * próximo processo continue o enquadramento (handoff). 0 ou -1 em erro */
+int chat_server_save_pending(ChatServer *s, int client_fd, const char *buf, size_t len);
+/* referências do histórico, da mais antiga à mais nova; retorna quantas ou -1 */
+int chat_server_export_history(ChatServer *s, envelope_t ***out_envs);
+/* recoloca no histórico as mensagens de um processo anterior (adquire
+ * referências); deve vir antes de chat_server_resume_seq */
+void chat_server_import_history(ChatServer *s, envelope_t **envs, int n);
+/* continua a numeração de sequência de um processo anterior */
+void chat_server_resume_seq(ChatServer *s, unsigned long next_seq);
 int chat_server_send_history(ChatServer *s, int client_fd, int n);
+/*
+ * Reenvia ao cliente só as mensagens com sequência maior que after_seq
+ * (retomada após reconexão). Se parte do intervalo já saiu do histórico,
+ * envia antes um aviso com o trecho perdido; se after_seq ainda não existe
+ * (o servidor recomeçou a numeração), envia o aviso "*** numeracao
+ * reiniciada" e o histórico inteiro. Mensagens novas só chegam ao
+ * cliente depois do replay. Retorna quantas mensagens foram reenviadas ou
+ * -1 em erro.
+ */
+int chat_server_send_since(ChatServer *s, int client_fd, unsigned long after_seq);
+/* retorna -1 se o nome já estiver em uso por outro cliente, for vazio ou
+ * começar com '#' (reservado ao número de sequência) */
 int chat_server_set_name(ChatServer *s, int client_fd, const char *name);
-const char *chat_server_get_name(ChatServer *s, int client_fd);
+/* copia o nome do cliente (truncado em size-1 bytes) para buf sob o lock;
+ * 0 se sucesso, -1 se o cliente não existe ou não tem nome */
+int chat_server_get_name(ChatServer *s, int client_fd, char *buf, size_t size);
+/* envia direto ao destinatário, sem passar pela fila do broadcaster.
+ * Retorna 0 se enviado, -1 se o destinatário não existe ou em erro. */
+int chat_server_send_private(ChatServer *s, int sender_fd, const char *target_name, const char *msg);
+/* liga/desliga o eco das próprias mensagens (usado pelo modo de carga do cliente) */
+int chat_server_set_echo(ChatServer *s, int client_fd, int on);
+/* muda o tempo de inatividade (vale para conexões novas; 0 desliga) */
+void chat_server_set_idle_timeout(ChatServer *s, int timeout_ms);
+/* referência para a conexão de client_fd, para uso da thread que lê dela */
+ChatConn *chat_server_conn_acquire(ChatServer *s, int client_fd);
+void chat_server_conn_release(ChatConn *c);
+/* registra atividade na conexão; O(1) e sem lock, chamado a cada recv */
+void chat_server_touch(ChatConn *c);
+/* envia bytes crus a um cliente usando o mesmo lock de escrita do broadcaster */
+int chat_server_send_to(ChatServer *s, int client_fd, const char *data, size_t len);
 
 #endif // CHAT_SERVER_H
@@ -0,0 +1,109 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "chat_server.h"
+#include "threadsafe_queue.h"
+#include <pthread.h>
+#include <netinet/in.h>
+
+/*
+ * Modo cluster: vários processos do servidor ligados por conexões TCP
+ * entre si (peers). Cada mensagem local é encaminhada aos peers como uma
+ * linha
+ *     FWD <origem> <época> <seq> <nome>\t<texto>\n
+ * e cada nó entrega a mensagem aos seus clientes e a repassa aos demais
+ * peers. Duplicatas (mesma origem+seq chegando por caminhos diferentes)
+ * são descartadas por uma janela deslizante por origem.
+ *
+ * A sequência do FWD é a do nó de origem e só serve para esse descarte. Ao
+ * ser entregue, a mensagem entra na fila local e recebe a próxima
+ * sequência deste nó, então o mesmo texto tem #N diferentes em cada nó e
+ * RESUME:<seq> vale só para o nó em que o cliente estava conectado.
+ *
+ * Um peer se identifica conectando na porta normal de clientes e enviando
+ * "PEER:<id> <época>\n" como primeira linha. Só são aceitos peers vindos
+ * de um endereço configurado (cluster_add_peer ou cluster_allow_peer); a
+ * época é o instante de início do nó em nanossegundos, e frames com época
+ * no futuro (além de CLUSTER_MAX_SKEW_MS) são descartados.
+ */
+
+#define CLUSTER_MAX_PEERS 16
+#define CLUSTER_MAX_NODES 64          /* ids válidos: 1..CLUSTER_MAX_NODES-1 */
+#define CLUSTER_DEDUP_WINDOW 1024     /* sequências lembradas por origem */
+#define CLUSTER_BATCH_BYTES 65536     /* maior write de um lote para um peer */
+#define CLUSTER_RETRY_MS 1000         /* intervalo entre tentativas e prazo de cada connect */
+#define CLUSTER_MAX_ALLOWED (2 * CLUSTER_MAX_PEERS) /* endereços aceitos como peer */
+#define CLUSTER_MAX_SKEW_MS 60000     /* diferença de relógio tolerada entre nós */
+
+typedef struct cluster_peer {
+    int fd;
+    int remote_id;                    /* 0 = desconhecido (conexão que nós abrimos) */
+    message_queue_t outq;             /* frames a enviar (envelopes compartilhados) */
+    pthread_t writer_tid;
+} cluster_peer_t;
+
+typedef struct {
+    struct Cluster *cluster;
+    char host[64];
+    int port;
+    pthread_t tid;
+    int fd;                           /* conexão atual ou -1 */
+} cluster_dialer_t;
+
+typedef struct {
+    unsigned long long epoch;
+    unsigned long max_seq;
+    unsigned long long bits[CLUSTER_DEDUP_WINDOW / 64];
+} cluster_origin_t;
+
+typedef struct Cluster {
+    ChatServer *chat;
+    int node_id;
+    unsigned long long epoch;         /* instante de início deste nó (ns) */
+
+    pthread_mutex_t mtx;              /* protege peers, dialers e origins */
+    pthread_cond_t cond;              /* sinalizado quando um peer sai */
+    cluster_peer_t *peers[CLUSTER_MAX_PEERS];
+    int num_peers;
+    cluster_dialer_t *dialers[CLUSTER_MAX_PEERS];
+    int num_dialers;
+    cluster_origin_t origins[CLUSTER_MAX_NODES];
+    struct in_addr allowed[CLUSTER_MAX_ALLOWED]; /* origens aceitas para "PEER:" */
+    int num_allowed;
+    int stopping;
+    int wake_pipe[2];                 /* escrito no shutdown: acorda dialers em connect */
+} Cluster;
+
+/**
+ * Inicializa o cluster e liga o encaminhamento das mensagens locais do chat.
+ * @return 0 se sucesso, -1 se erro (ex.: node_id fora do intervalo).
+ */
+int cluster_init(Cluster *c, ChatServer *chat, int node_id);
+
+/**
+ * Aceita conexões de peer vindas de host (chamar antes de servir clientes).
+ * @return 0 se sucesso, -1 se host não resolve ou a lista está cheia.
+ */
+int cluster_allow_peer(Cluster *c, const char *host);
+
+/**
+ * Mantém uma conexão com o peer em host:port (reconecta se cair); host
+ * também passa a ser aceito como origem de conexões de peer.
+ * @return 0 se a thread de conexão foi criada, -1 se erro.
+ */
+int cluster_add_peer(Cluster *c, const char *host, int port);
+
+/**
+ * Atende uma conexão de peer aceita na porta de clientes, a partir da linha
+ * "PEER:" já lida. pending/pending_len são bytes já recebidos depois dela.
+ * Recusa conexões de endereços não configurados. Bloqueia até o peer
+ * desconectar; não fecha fd.
+ */
+void cluster_serve_peer(Cluster *c, int fd, const char *hello, const char *pending, size_t pending_len);
+
+/**
+ * Derruba as conexões com peers e espera as threads terminarem.
+ */
+void cluster_shutdown(Cluster *c);
+
+#endif // CLUSTER_H
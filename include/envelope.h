@@ -0,0 +1,42 @@
+#ifndef ENVELOPE_H
+#define ENVELOPE_H
+
+#include <stddef.h>
+
+/**
+ * Envelope de mensagem: bytes já serializados ("[HH:MM:SS] #seq nome: texto\n")
+ * montados uma única vez no enfileiramento e compartilhados, por contagem
+ * de referências, entre a fila, o histórico e os envios aos destinatários.
+ */
+typedef struct {
+    unsigned long seq;
+    size_t len;
+    int refs;
+    char data[];
+} envelope_t;
+
+/**
+ * Cria um envelope com referência inicial 1.
+ * @param seq: número de sequência atribuído pelo servidor (0 = sem sequência).
+ * @param name: nome do remetente.
+ * @param text: texto da mensagem (newline/CR finais são descartados).
+ * @return envelope alocado ou NULL em erro.
+ */
+envelope_t *envelope_create(unsigned long seq, const char *name, const char *text);
+
+/**
+ * Cria um envelope a partir de bytes já serializados (copiados como estão).
+ */
+envelope_t *envelope_from_bytes(unsigned long seq, const char *data, size_t len);
+
+/**
+ * Adquire uma referência extra. Retorna o próprio envelope.
+ */
+envelope_t *envelope_ref(envelope_t *env);
+
+/**
+ * Libera uma referência; o envelope é desalocado na última.
+ */
+void envelope_unref(envelope_t *env);
+
+#endif // ENVELOPE_H
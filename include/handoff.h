@@ -0,0 +1,78 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stddef.h>
+#include "envelope.h"
+
+/*
+ * Handoff de sockets entre processos do servidor (reinício sem reconexões).
+ * O processo antigo escuta num socket Unix (SOCK_SEQPACKET); o novo conecta
+ * e recebe numa primeira mensagem o socket de escuta e os sockets dos
+ * clientes via SCM_RIGHTS, junto com os nomes e a próxima sequência. As
+ * linhas incompletas de cada cliente e o histórico seguem em mensagens
+ * seguintes, para o novo processo continuar o enquadramento e o RESUME.
+ *
+ * A troca só se completa quando o novo processo, já inicializado, responde
+ * "ACK" (handoff_ack) e o antigo confirma com "GO" (handoff_wait_ack). Se o
+ * novo processo cair antes ou o antigo desistir, nenhum dos dois assume
+ * sozinho: o antigo volta a atender e o novo sai.
+ */
+
+#define HANDOFF_MAX_FDS 253 /* SCM_MAX_FD do Linux (escuta + clientes) */
+
+typedef struct {
+    int listen_fd;
+    int num_clients;
+    int *client_fds;
+    char **names;       /* paralelo a client_fds; entradas nullable */
+    char **pending;     /* bytes já lidos de uma linha incompleta; nullable */
+    size_t *pending_len;
+    unsigned long next_seq;
+    envelope_t **history; /* da mais antiga à mais nova (uma referência cada) */
+    int history_count;
+    int conn_fd;          /* conexão com o processo antigo até handoff_ack; -1 */
+} handoff_state_t;
+
+/**
+ * Cria o socket Unix de handoff em path (remove um arquivo antigo).
+ * @return fd de escuta ou -1 em erro.
+ */
+int handoff_listen(const char *path);
+
+/**
+ * Conecta ao processo em execução em path e recebe o estado.
+ * @param timeout_ms quanto esperar pelo processo antigo (que drena a fila
+ *        antes de responder) a cada leitura.
+ * @return 0 se recebeu, 1 se não há servidor escutando em path, -1 em erro.
+ */
+int handoff_receive(const char *path, handoff_state_t *st, int timeout_ms);
+
+/**
+ * Confirma ao processo antigo que o estado recebido foi assumido e espera
+ * a resposta dele; fecha st->conn_fd. Só depois de 0 o novo processo pode
+ * usar os sockets: com -1 o antigo continua servindo com eles.
+ * @return 0 se o antigo liberou os sockets, -1 caso contrário.
+ */
+int handoff_ack(handoff_state_t *st);
+
+/**
+ * Envia o estado pela conexão aceita em handoff_listen.
+ * @return 0 se sucesso, -1 em erro.
+ */
+int handoff_send(int conn_fd, const handoff_state_t *st);
+
+/**
+ * Depois de handoff_send, espera o "ACK" do novo processo por até
+ * timeout_ms e libera os sockets com "GO".
+ * @return 0 se o novo processo assumiu, -1 se não confirmou (o chamador
+ *         fecha conn_fd e continua servindo).
+ */
+int handoff_wait_ack(int conn_fd, int timeout_ms);
+
+/**
+ * Libera os arrays do estado e as referências do histórico (não fecha os
+ * sockets nem conn_fd).
+ */
+void handoff_state_free(handoff_state_t *st);
+
+#endif // HANDOFF_H
@@ -9,4 +9,8 @@
  * número de bytes enviados (== len) ou -1 em erro. */
 ssize_t send_all(int fd, const void *buf, size_t len);
 
+/* Como send_all, mas o envio inteiro (não cada send) termina em até
+ * timeout_ms; estourado o prazo retorna -1 com errno = ETIMEDOUT. */
+ssize_t send_all_timeout(int fd, const void *buf, size_t len, int timeout_ms);
+
 #endif // NET_H
@@ -0,0 +1,42 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+/*
+ * Varredura dos buffers de leitura: acha o fim das linhas e valida o texto
+ * das mensagens. No x86-64 usa SSE2 ou AVX2 (escolhido em tempo de
+ * execução pela CPU); nas outras arquiteturas usa as versões escalares.
+ */
+
+/* posição do primeiro '\n' em buf[0..len), ou len se não houver */
+size_t scan_delim(const char *buf, size_t len);
+
+/*
+ * 0 se buf[0..len) é UTF-8 bem formado e sem caracteres de controle
+ * (exceto '\t'), -1 caso contrário. Rejeita sequências overlong,
+ * surrogates e pontos de código acima de U+10FFFF.
+ */
+int scan_validate(const char *buf, size_t len);
+
+/*
+ * Valida um trecho com várias linhas numa passada só: como scan_validate,
+ * mas aceita '\n' e "\r\n". Retorna len se tudo é válido, ou a posição
+ * (sempre no início de um caractere) onde parou: um byte inválido ou uma
+ * sequência cortada no fim do buffer. Chamar de novo a partir dessa
+ * posição, com mais dados, continua a validação.
+ */
+size_t scan_validate_lines(const char *buf, size_t len);
+
+/* maior corte <= len que não divide um caractere UTF-8 ao meio */
+size_t scan_utf8_boundary(const char *buf, size_t len);
+
+/* nome da implementação escolhida ("avx2", "sse2" ou "escalar") */
+const char *scan_impl_name(void);
+
+/* versões byte a byte, usadas como referência no benchmark */
+size_t scan_delim_scalar(const char *buf, size_t len);
+int scan_validate_scalar(const char *buf, size_t len);
+size_t scan_validate_lines_scalar(const char *buf, size_t len);
+
+#endif // SCAN_H
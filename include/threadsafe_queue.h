@@ -2,25 +2,31 @@
 #define THREADSAFE_QUEUE_H
 
 #include <pthread.h>
+#include "envelope.h"
+#include "cacheline.h"
 
 typedef struct mq_item {
-    char *msg;
+    envelope_t *env;
     int sender;
     struct mq_item *next;
 } mq_item_t;
 
+/* cabeça e cauda ficam juntas (são protegidas pelo mesmo mutex); o
+ * alinhamento impede que a fila divida linha de cache com outros campos */
 typedef struct {
     mq_item_t *head;
     mq_item_t *tail;
     pthread_mutex_t mtx;
     pthread_cond_t cond;
     int closed;
-} message_queue_t;
+} CACHE_ALIGNED message_queue_t;
 
 int mq_init(message_queue_t *q);
-int mq_push(message_queue_t *q, const char *msg, int sender);
-int mq_pop(message_queue_t *q, char **out_msg, int *out_sender); /* returns 0 on success, -1 if closed */
+int mq_push(message_queue_t *q, envelope_t *env, int sender); /* adquire uma referência do envelope */
+int mq_pop(message_queue_t *q, envelope_t **out_env, int *out_sender); /* returns 0 on success, -1 if closed */
+int mq_try_pop(message_queue_t *q, envelope_t **out_env, int *out_sender); /* não bloqueia; -1 se vazia */
 void mq_close(message_queue_t *q);
+void mq_reopen(message_queue_t *q); /* desfaz mq_close; os itens que restaram continuam na fila */
 void mq_destroy(message_queue_t *q);
 
 #endif // THREADSAFE_QUEUE_H
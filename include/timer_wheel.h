@@ -0,0 +1,49 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+/*
+ * Roda de timers hierárquica (4 níveis de 64 posições). Agendar e cancelar
+ * são O(1); avançar um tick é O(1) mais os timers que vencem ou descem de
+ * nível. Os timers são intrusivos (embutidos na estrutura do dono) e a roda
+ * não tem lock próprio: o chamador serializa o acesso.
+ */
+
+#define TW_LEVELS 4
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+
+typedef struct tw_timer {
+    struct tw_timer *next;
+    struct tw_timer **pprev;   /* NULL quando o timer não está na roda */
+    unsigned long expires;     /* em ticks */
+    void *data;
+} tw_timer_t;
+
+typedef struct {
+    unsigned long now;         /* último tick processado */
+    tw_timer_t *slots[TW_LEVELS][TW_SLOTS];
+} timer_wheel_t;
+
+typedef void (*tw_callback_t)(tw_timer_t *t, void *arg);
+
+void tw_init(timer_wheel_t *tw, unsigned long now);
+void tw_timer_init(tw_timer_t *t, void *data);
+
+/**
+ * Agenda (ou reagenda) o timer para o tick expires. Vencimentos no passado
+ * disparam no próximo tick.
+ */
+void tw_schedule(timer_wheel_t *tw, tw_timer_t *t, unsigned long expires);
+
+/**
+ * Remove o timer da roda (sem efeito se não estiver agendado).
+ */
+void tw_cancel(tw_timer_t *t);
+
+/**
+ * Avança a roda até o tick now, chamando cb para cada timer vencido. O timer
+ * já foi removido da roda quando cb é chamado e pode ser reagendado por ela.
+ */
+void tw_advance(timer_wheel_t *tw, unsigned long now, tw_callback_t cb, void *arg);
+
+#endif // TIMER_WHEEL_H
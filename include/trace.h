@@ -0,0 +1,58 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Tracing opcional do caminho de uma mensagem (recv -> enqueue -> fila ->
+ * broadcaster -> send). Compilado só com -DCHAT_TRACE (make TRACE=1); sem
+ * ele as macros viram no-ops e não custam nada.
+ *
+ * Cada thread grava eventos (estágio, sequência, timestamp) no seu próprio
+ * buffer circular, sem locks. trace_dump junta os buffers num arquivo JSON
+ * no formato Chrome trace, que abre no Perfetto (ui.perfetto.dev) ou em
+ * chrome://tracing.
+ */
+
+typedef enum {
+    TRACE_RECV,        /* recv na client_thread que trouxe a mensagem */
+    TRACE_ENQUEUE,     /* envelope montado e sequência atribuída */
+    TRACE_MQ_PUSH,     /* entrou na fila */
+    TRACE_MQ_POP,      /* saiu da fila no broadcaster */
+    TRACE_SEND_BEGIN,  /* broadcaster começou a enviar aos destinatários */
+    TRACE_SEND_END,    /* último send_all do broadcast terminou */
+    TRACE_STAGE_COUNT
+} trace_stage_t;
+
+#ifdef CHAT_TRACE
+
+#include <stdint.h>
+
+/* timestamp bruto: TSC em x86-64, CLOCK_MONOTONIC (ns) nos demais */
+uint64_t trace_now(void);
+
+/* grava um evento no buffer da thread atual */
+void trace_record(trace_stage_t stage, unsigned long seq, uint64_t ts);
+
+/* guarda o timestamp do recv atual; é gravado (uma vez) quando a primeira
+ * mensagem completada por esse recv ganha sequência */
+void trace_mark_recv(void);
+void trace_flush_recv(unsigned long seq);
+
+/**
+ * Escreve todos os buffers em path (JSON Chrome trace).
+ * @return número de eventos escritos ou -1 em erro.
+ */
+int trace_dump(const char *path);
+
+#define TRACE(stage, seq) trace_record((stage), (seq), trace_now())
+#define TRACE_MARK_RECV() trace_mark_recv()
+#define TRACE_FLUSH_RECV(seq) trace_flush_recv(seq)
+
+#else
+
+#define TRACE(stage, seq) ((void)0)
+#define TRACE_MARK_RECV() ((void)0)
+#define TRACE_FLUSH_RECV(seq) ((void)0)
+
+#endif // CHAT_TRACE
+
+#endif // TRACE_H
@@ -22,6 +22,18 @@ typedef enum {
  */
 int tslog_init(const char *filename, int overwrite);
 
+/**
+ * Inicializa o logger em modo particionado: cada thread escreve no seu
+ * próprio arquivo <prefix>.<pid>.<shard>.<parte>.log, sem lock
+ * compartilhado entre threads. Cada linha começa com o instante
+ * CLOCK_MONOTONIC em ns, usado pelo tslog_merge para intercalar os shards.
+ * @param prefix: prefixo dos arquivos (pode incluir diretório).
+ * @param max_bytes: rotaciona a parte ao passar deste tamanho (0 = sem limite).
+ * @param max_age_s: rotaciona a parte após tantos segundos (0 = sem limite).
+ * @return 0 se sucesso, -1 se erro.
+ */
+int tslog_init_sharded(const char *prefix, size_t max_bytes, int max_age_s);
+
 /**
  * Fecha o logger e libera recursos.
  */
@@ -0,0 +1,59 @@
+#define _GNU_SOURCE
+#include "affinity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <dirent.h>
+
+int affinity_parse_cpus(const char *list, int *cpus, int max) {
+    if (!list || !*list) return -1;
+    int n = 0;
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long lo = strtol(p, &end, 10);
+        if (end == p || lo < 0 || lo >= CPU_SETSIZE) return -1;
+        long hi = lo;
+        p = end;
+        if (*p == '-') {
+            p++;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo || hi >= CPU_SETSIZE) return -1;
+            p = end;
+        }
+        for (long c = lo; c <= hi && n < max; c++) cpus[n++] = (int)c;
+        if (*p == ',') {
+            p++;
+        } else if (*p) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+int affinity_attr_set(pthread_attr_t *attr, int cpu) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) return -1;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_attr_setaffinity_np(attr, sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+int affinity_cpu_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir) return -1;
+    int node = -1;
+    struct dirent *e;
+    /* o diretório da CPU tem um link "nodeN" para o seu nó */
+    while ((e = readdir(dir)) != NULL) {
+        if (strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9') {
+            node = atoi(e->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
@@ -1,49 +1,281 @@
 #include "chat_server.h"
 #include "tslog.h"
 #include "net.h"
+#include "trace.h"
+#include "affinity.h"
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+/* relógio grosso (alguns ms de resolução) mas barato: usado a cada recv */
+static long long mono_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned long ms_to_tick(long long ms) {
+    return (unsigned long)((ms + CHAT_TICK_MS - 1) / CHAT_TICK_MS);
+}
+
+static ChatConn *conn_create(int fd) {
+    /* ChatConn tem campos alinhados em linha de cache: calloc não garante isso */
+    ChatConn *c = NULL;
+    if (posix_memalign((void **)&c, CACHE_LINE, sizeof(ChatConn)) != 0) return NULL;
+    memset(c, 0, sizeof(ChatConn));
+    if (pthread_mutex_init(&c->send_mtx, NULL) != 0) {
+        free(c);
+        return NULL;
+    }
+    c->fd = fd;
+    c->refs = 1;
+    c->last_seen_ms = mono_ms();
+    c->pinged_at_ms = -1;
+    tw_timer_init(&c->idle_timer, c);
+    return c;
+}
+
+static ChatConn *conn_ref(ChatConn *c) {
+    if (c) __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+    return c;
+}
+
+/* libera uma referência; na última fecha o socket e desaloca */
+static void conn_release(ChatConn *c) {
+    if (!c) return;
+    if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(c->fd);
+        pthread_mutex_destroy(&c->send_mtx);
+        free(c->name);
+        free(c->pending);
+        free(c);
+    }
+}
+
+static ssize_t conn_send(ChatConn *c, const void *buf, size_t len) {
+    pthread_mutex_lock(&c->send_mtx);
+    ssize_t rc = send_all_timeout(c->fd, buf, len, CHAT_SEND_TIMEOUT_MS);
+    pthread_mutex_unlock(&c->send_mtx);
+    return rc;
+}
+
+/* envio sem espera, para o reaper: -1 se outro envio está em curso ou o
+ * buffer do socket está cheio (nada foi enviado) */
+static int conn_try_send(ChatConn *c, const void *buf, size_t len) {
+    if (pthread_mutex_trylock(&c->send_mtx) != 0) return -1;
+    ssize_t n;
+    do {
+        n = send(c->fd, buf, len, MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0 && (size_t)n < len) {
+        /* o começo já saiu: termina (são poucos bytes) para não quebrar
+         * o enquadramento das linhas */
+        n = send_all_timeout(c->fd, (const char *)buf + n, len - (size_t)n, CHAT_SEND_TIMEOUT_MS) < 0 ? -1 : (ssize_t)len;
+    }
+    pthread_mutex_unlock(&c->send_mtx);
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+/* as funções *_locked exigem clients_mtx */
+static int find_client_locked(ChatServer *s, int client_fd) {
+    for (int i = 0; i < s->num_clients; ++i) {
+        if (s->clients[i] == client_fd) return i;
+    }
+    return -1;
+}
+
+static unsigned name_hash(const char *name) {
+    unsigned h = 5381;
+    for (const unsigned char *p = (const unsigned char *)name; *p; ++p) {
+        h = h * 33 + *p;
+    }
+    return h;
+}
+
+static ChatConn *name_lookup_locked(ChatServer *s, const char *name) {
+    ChatConn *c = s->name_index[name_hash(name) % s->name_index_size];
+    while (c && strcmp(c->name, name) != 0) c = c->name_next;
+    return c;
+}
+
+static void name_unlink_locked(ChatServer *s, ChatConn *conn) {
+    if (!conn->name) return;
+    ChatConn **pp = &s->name_index[name_hash(conn->name) % s->name_index_size];
+    while (*pp && *pp != conn) pp = &(*pp)->name_next;
+    if (*pp) *pp = conn->name_next;
+    conn->name_next = NULL;
+}
+
+/* prazo de um drain em andamento já venceu? */
+static int drain_expired(ChatServer *s) {
+    long long deadline = __atomic_load_n(&s->drain_deadline_ms, __ATOMIC_RELAXED);
+    return deadline != 0 && mono_ms() >= deadline;
+}
 
 static void *broadcaster_func(void *arg) {
     ChatServer *s = (ChatServer *)arg;
-    char *msg = NULL;
+    envelope_t *env = NULL;
     int sender;
     /*
-     * Thread broadcaster: consome mensagens da fila de mensagens e as
+     * Thread broadcaster: consome envelopes da fila de mensagens e os
      * encaminha para todos os clientes conectados, exceto o remetente.
      * A thread mantém o mutex de clients enquanto itera a lista para
-     * garantir consistência. A posse da mensagem é transferida por
-     * mq_pop (que retorna uma string alocada no heap que o broadcaster
-     * deve liberar).
+     * garantir consistência. O envelope já vem serializado (nome,
+     * horário e sequência), então os mesmos bytes vão para todos os
+     * destinatários sem reformatar; mq_pop transfere uma referência
+     * que o broadcaster deve liberar.
      */
     while (s->running) {
-        if (mq_pop(&s->mq, &msg, &sender) != 0) {
+        if (mq_pop(&s->mq, &env, &sender) != 0) {
             break; // queue fechada e vazia
         }
+        TRACE(TRACE_MQ_POP, env->seq);
         pthread_mutex_lock(&s->clients_mtx); //obtem lock para iterar clients
-        int targets = 0;
+        TRACE(TRACE_SEND_BEGIN, env->seq);
+        int targets = 0, skipped = 0;
         for (int i = 0; i < s->num_clients; i++) {
             int fd = s->clients[i];
-            if (fd != sender) {
-                if (send_all(fd, msg, strlen(msg)) < 0) {
+            if (fd != sender || s->conns[i]->echo) {
+                /* cada envio pode bloquear até CHAT_SEND_TIMEOUT_MS; depois do
+                 * prazo do drain os envios restantes são abandonados */
+                if (drain_expired(s)) {
+                    skipped++;
+                    continue;
+                }
+                if (conn_send(s->conns[i], env->data, env->len) < 0) {
                     tslog_write(LOG_WARN, "Falha ao enviar para cliente %d: %s", fd, strerror(errno));
                 }
                 targets++;
             }
         }
+        TRACE(TRACE_SEND_END, env->seq);
         pthread_mutex_unlock(&s->clients_mtx); //libera lock apos iterar clients
+        if (skipped > 0) {
+            tslog_write(LOG_WARN, "Drain: prazo estourado, seq=%lu nao enviada a %d cliente(s)", env->seq, skipped);
+        }
         /* registra que o broadcast foi enviado e quantos alvos */
-        tslog_write(LOG_INFO, "Broadcast enviado (remetente=%d, alvos=%d)", sender, targets);
-        free(msg);
-        msg = NULL;
+        tslog_write(LOG_INFO, "Broadcast enviado (seq=%lu, remetente=%d, alvos=%d)", env->seq, sender, targets);
+        envelope_unref(env);
+        env = NULL;
+    }
+    /* avisa um possível drain de que a fila foi esvaziada */
+    pthread_mutex_lock(&s->drain_mtx);
+    s->broadcaster_done = 1;
+    pthread_cond_broadcast(&s->drain_cond);
+    pthread_mutex_unlock(&s->drain_mtx);
+    return NULL;
+}
+
+/* timers vencidos num tick; processados fora do wheel_mtx */
+typedef struct {
+    ChatConn **conns;
+    int n;
+    int cap;
+    timer_wheel_t *wheel;
+} reap_batch_t;
+
+static void idle_expired(tw_timer_t *t, void *arg) {
+    reap_batch_t *b = (reap_batch_t *)arg;
+    if (b->n < b->cap) {
+        b->conns[b->n++] = conn_ref((ChatConn *)t->data);
+    } else {
+        tw_schedule(b->wheel, t, b->wheel->now + 1); // lote cheio: fica para o próximo tick
+    }
+}
+
+/* decide o que fazer com uma conexão cujo timer venceu */
+static void check_idle(ChatServer *s, ChatConn *c) {
+    long long timeout = s->idle_timeout_ms;
+    if (timeout <= 0) return;
+    long long now = mono_ms();
+    long long last = __atomic_load_n(&c->last_seen_ms, __ATOMIC_RELAXED);
+    long long next;
+    if (now - last >= timeout) {
+        /* sem resposta nem ao PING: derruba a conexão. O recv da
+         * client_thread retorna e ela faz a remoção normal, liberando a vaga */
+        tslog_write(LOG_WARN, "Cliente %d inativo ha %lld ms; desconectando", c->fd, now - last);
+        shutdown(c->fd, SHUT_RDWR);
+        return;
+    }
+    if (now - last >= timeout / 2) {
+        next = last + timeout;
+        if (c->pinged_at_ms != last) {
+            /* o reaper atende todas as conexões: não espera um envio em
+             * curso nem um socket cheio, tenta de novo no próximo tick */
+            if (conn_try_send(c, "PING\n", 5) == 0) {
+                c->pinged_at_ms = last;
+            } else if (now + CHAT_TICK_MS < next) {
+                next = now + CHAT_TICK_MS;
+            }
+        }
+    } else {
+        /* houve atividade desde o agendamento: só empurra o prazo */
+        next = last + timeout / 2;
     }
+    pthread_mutex_lock(&s->wheel_mtx);
+    if (!c->removed) tw_schedule(&s->wheel, &c->idle_timer, ms_to_tick(next));
+    pthread_mutex_unlock(&s->wheel_mtx);
+}
+
+static void *reaper_func(void *arg) {
+    ChatServer *s = (ChatServer *)arg;
+    /*
+     * Thread reaper: uma única thread acompanha a inatividade de todas as
+     * conexões. Cada conexão tem um timer na roda; o recv apenas grava
+     * last_seen (sem lock) e o timer, ao vencer, confere esse valor e se
+     * reagenda, manda PING ou derruba a conexão.
+     */
+    reap_batch_t batch = { calloc(s->max_clients, sizeof(ChatConn*)), 0, s->max_clients, &s->wheel };
+    if (!batch.conns) return NULL;
+    pthread_mutex_lock(&s->wheel_mtx);
+    while (s->running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += CHAT_TICK_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&s->reaper_cond, &s->wheel_mtx, &deadline);
+        if (!s->running) break;
+        batch.n = 0;
+        tw_advance(&s->wheel, (unsigned long)(mono_ms() / CHAT_TICK_MS), idle_expired, &batch);
+        pthread_mutex_unlock(&s->wheel_mtx);
+        for (int i = 0; i < batch.n; i++) {
+            check_idle(s, batch.conns[i]);
+            conn_release(batch.conns[i]);
+        }
+        pthread_mutex_lock(&s->wheel_mtx);
+    }
+    pthread_mutex_unlock(&s->wheel_mtx);
+    free(batch.conns);
     return NULL;
 }
 
-int chat_server_init(ChatServer *s, int max_clients, int history_size) {
+/* cria a thread broadcaster, fixa em cpu se possível; 0 ou -1 */
+static int start_broadcaster(ChatServer *s, int cpu) {
+    /* fixado já na criação, como as threads de cliente; o broadcaster não
+     * tem buffers próprios grandes (os envelopes vêm das threads de cliente) */
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    s->broadcaster_cpu = -1;
+    if (cpu >= 0 && affinity_attr_set(&attr, cpu) == 0) s->broadcaster_cpu = cpu;
+    int rc = pthread_create(&s->broadcaster_tid, &attr, broadcaster_func, s);
+    pthread_attr_destroy(&attr);
+    if (rc != 0 && s->broadcaster_cpu >= 0) {
+        /* CPU inexistente/offline: roda sem fixação */
+        s->broadcaster_cpu = -1;
+        rc = pthread_create(&s->broadcaster_tid, NULL, broadcaster_func, s);
+    }
+    return rc == 0 ? 0 : -1;
+}
+
+int chat_server_init(ChatServer *s, int max_clients, int history_size, int broadcaster_cpu) {
     if (!s) return -1;
     s->clients = calloc(max_clients, sizeof(int));
     if (!s->clients) return -1;
@@ -67,12 +299,20 @@ int chat_server_init(ChatServer *s, int max_clients, int history_size) {
     }
 
     s->history_size = history_size > 0 ? history_size : CHAT_HISTORY_DEFAULT;
-    s->history = calloc(s->history_size, sizeof(char*));
+    s->history = calloc(s->history_size, sizeof(envelope_t*));
     s->history_start = 0;
     s->history_count = 0;
+    s->next_seq = 1;
+    s->message_hook = NULL;
+    s->message_hook_arg = NULL;
 
-    s->client_names = calloc(max_clients, sizeof(char*));
-    if (!s->client_names) {
+    s->conns = calloc(max_clients, sizeof(ChatConn*));
+    /* índice com o dobro de buckets mantém as cadeias curtas */
+    s->name_index_size = max_clients * 2 + 1;
+    s->name_index = calloc(s->name_index_size, sizeof(ChatConn*));
+    if (!s->conns || !s->name_index) {
+        free(s->name_index);
+        free(s->conns);
         free(s->history);
         mq_destroy(&s->mq);
         sem_destroy(&s->slots);
@@ -81,13 +321,74 @@ int chat_server_init(ChatServer *s, int max_clients, int history_size) {
         return -1;
     }
 
+    /* o drain usa prazos absolutos no relógio monotônico */
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    if (pthread_mutex_init(&s->drain_mtx, NULL) != 0 ||
+        pthread_cond_init(&s->drain_cond, &cattr) != 0) {
+        pthread_condattr_destroy(&cattr);
+        free(s->name_index);
+        free(s->conns);
+        free(s->history);
+        mq_destroy(&s->mq);
+        sem_destroy(&s->slots);
+        pthread_mutex_destroy(&s->clients_mtx);
+        free(s->clients);
+        return -1;
+    }
+    s->broadcaster_done = 0;
+    s->broadcaster_joined = 0;
+
+    if (pthread_mutex_init(&s->wheel_mtx, NULL) != 0 ||
+        pthread_cond_init(&s->reaper_cond, &cattr) != 0) {
+        pthread_condattr_destroy(&cattr);
+        pthread_cond_destroy(&s->drain_cond);
+        pthread_mutex_destroy(&s->drain_mtx);
+        free(s->name_index);
+        free(s->conns);
+        free(s->history);
+        mq_destroy(&s->mq);
+        sem_destroy(&s->slots);
+        pthread_mutex_destroy(&s->clients_mtx);
+        free(s->clients);
+        return -1;
+    }
+    pthread_condattr_destroy(&cattr);
+    tw_init(&s->wheel, (unsigned long)(mono_ms() / CHAT_TICK_MS));
+    s->idle_timeout_ms = CHAT_IDLE_TIMEOUT_MS;
+
     s->running = 1;
-    if (pthread_create(&s->broadcaster_tid, NULL, broadcaster_func, s) != 0) {
+    if (start_broadcaster(s, broadcaster_cpu) != 0) {
         /* cleanup on failure */
+        pthread_cond_destroy(&s->reaper_cond);
+        pthread_mutex_destroy(&s->wheel_mtx);
+        pthread_cond_destroy(&s->drain_cond);
+        pthread_mutex_destroy(&s->drain_mtx);
+        mq_destroy(&s->mq);
+        sem_destroy(&s->slots);
+        pthread_mutex_destroy(&s->clients_mtx);
+        free(s->clients);
+        free(s->conns);
+        free(s->name_index);
+        free(s->history);
+        return -1;
+    }
+    if (pthread_create(&s->reaper_tid, NULL, reaper_func, s) != 0) {
+        /* desfaz o broadcaster já criado e o resto */
+        s->running = 0;
+        mq_close(&s->mq);
+        pthread_join(s->broadcaster_tid, NULL);
+        pthread_cond_destroy(&s->reaper_cond);
+        pthread_mutex_destroy(&s->wheel_mtx);
+        pthread_cond_destroy(&s->drain_cond);
+        pthread_mutex_destroy(&s->drain_mtx);
         mq_destroy(&s->mq);
         sem_destroy(&s->slots);
         pthread_mutex_destroy(&s->clients_mtx);
         free(s->clients);
+        free(s->conns);
+        free(s->name_index);
         free(s->history);
         return -1;
     }
@@ -99,86 +400,257 @@ int chat_server_add_client(ChatServer *s, int client_fd) {
     if (sem_trywait(&s->slots) != 0) {
         return -1; // no slots
     }
+    ChatConn *conn = conn_create(client_fd);
+    if (!conn) {
+        sem_post(&s->slots);
+        return -1;
+    }
+    struct timeval tv = { CHAT_SEND_TIMEOUT_MS / 1000, (CHAT_SEND_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
     pthread_mutex_lock(&s->clients_mtx); //obtem lock para modificar clients
     if (s->num_clients >= s->max_clients) {
         pthread_mutex_unlock(&s->clients_mtx);
         sem_post(&s->slots);
+        pthread_mutex_destroy(&conn->send_mtx);
+        free(conn);
         return -1;
     }
-    s->clients[s->num_clients++] = client_fd;
-    s->client_names[s->num_clients-1] = NULL;
+    s->clients[s->num_clients] = client_fd;
+    s->conns[s->num_clients] = conn;
+    s->num_clients++;
     pthread_mutex_unlock(&s->clients_mtx); //libera lock apos modificar clients
+    if (s->idle_timeout_ms > 0) {
+        pthread_mutex_lock(&s->wheel_mtx);
+        tw_schedule(&s->wheel, &conn->idle_timer, ms_to_tick(conn->last_seen_ms + s->idle_timeout_ms / 2));
+        pthread_mutex_unlock(&s->wheel_mtx);
+    }
     tslog_write(LOG_INFO, "Cliente adicionado (fd=%d), total=%d", client_fd, s->num_clients);
     return 0;
 }
 
 void chat_server_remove_client(ChatServer *s, int client_fd) {
     if (!s) return;
+    ChatConn *removed = NULL;
     pthread_mutex_lock(&s->clients_mtx); //obtem lock para remover um cliente
-    for (int i = 0; i < s->num_clients; i++) {
-        if (s->clients[i] == client_fd) {
-            s->clients[i] = s->clients[s->num_clients-1];
-            /* move name too */
-            free(s->client_names[i]);
-            s->client_names[i] = s->client_names[s->num_clients-1];
-            s->client_names[s->num_clients-1] = NULL;
-            s->num_clients--;
-            break;
-        }
+    int i = find_client_locked(s, client_fd);
+    if (i >= 0) {
+        removed = s->conns[i];
+        name_unlink_locked(s, removed);
+        /* move o último para a posição liberada */
+        s->clients[i] = s->clients[s->num_clients-1];
+        s->conns[i] = s->conns[s->num_clients-1];
+        s->conns[s->num_clients-1] = NULL;
+        s->num_clients--;
     }
     pthread_mutex_unlock(&s->clients_mtx); //liber lock apos remover um cliente
+    if (removed) {
+        pthread_mutex_lock(&s->wheel_mtx);
+        removed->removed = 1;
+        tw_cancel(&removed->idle_timer);
+        pthread_mutex_unlock(&s->wheel_mtx);
+    }
+    /* fora do lock: pode fechar o socket se ninguém mais o estiver usando */
+    conn_release(removed);
     sem_post(&s->slots);
+    pthread_mutex_lock(&s->drain_mtx);
+    pthread_cond_broadcast(&s->drain_cond);
+    pthread_mutex_unlock(&s->drain_mtx);
     tslog_write(LOG_INFO, "Cliente removido (fd=%d), total=%d", client_fd, s->num_clients);
 }
 
-/* define o nome de um cliente já registrado (faz strdup) */
+/* define o nome de um cliente já registrado (faz strdup) e o indexa */
 int chat_server_set_name(ChatServer *s, int client_fd, const char *name) {
-    if (!s || !name) return -1;
+    /* "#" no começo faria uma privada ("[hora] #9 -> x: ...") parecer um
+     * broadcast numerado para o cliente */
+    if (!s || !name || !name[0] || name[0] == '#') return -1;
     pthread_mutex_lock(&s->clients_mtx);
-    for (int i = 0; i < s->num_clients; ++i) {
-        if (s->clients[i] == client_fd) {
-            char *dup = strdup(name);
-            if (!dup) { pthread_mutex_unlock(&s->clients_mtx); return -1; }
-            free(s->client_names[i]);
-            s->client_names[i] = dup;
-            pthread_mutex_unlock(&s->clients_mtx);
-            return 0;
-        }
+    int i = find_client_locked(s, client_fd);
+    ChatConn *owner = name_lookup_locked(s, name);
+    if (i < 0 || (owner && owner != s->conns[i])) {
+        pthread_mutex_unlock(&s->clients_mtx);
+        return -1; // cliente inexistente ou nome já em uso
     }
+    ChatConn *conn = s->conns[i];
+    char *dup = strdup(name);
+    if (!dup) { pthread_mutex_unlock(&s->clients_mtx); return -1; }
+    name_unlink_locked(s, conn);
+    free(conn->name);
+    conn->name = dup;
+    unsigned b = name_hash(dup) % s->name_index_size;
+    conn->name_next = s->name_index[b];
+    s->name_index[b] = conn;
     pthread_mutex_unlock(&s->clients_mtx);
-    return -1;
+    return 0;
+}
+
+int chat_server_set_echo(ChatServer *s, int client_fd, int on) {
+    if (!s) return -1;
+    pthread_mutex_lock(&s->clients_mtx);
+    int i = find_client_locked(s, client_fd);
+    if (i >= 0) s->conns[i]->echo = on;
+    pthread_mutex_unlock(&s->clients_mtx);
+    return i >= 0 ? 0 : -1;
 }
 
-/* get name (caller must not free) */
-const char *chat_server_get_name(ChatServer *s, int client_fd) {
+void chat_server_set_idle_timeout(ChatServer *s, int timeout_ms) {
+    if (!s) return;
+    s->idle_timeout_ms = timeout_ms > 0 ? timeout_ms : 0;
+}
+
+ChatConn *chat_server_conn_acquire(ChatServer *s, int client_fd) {
     if (!s) return NULL;
-    const char *res = NULL;
     pthread_mutex_lock(&s->clients_mtx);
-    for (int i = 0; i < s->num_clients; ++i) {
-        if (s->clients[i] == client_fd) { res = s->client_names[i]; break; }
+    int i = find_client_locked(s, client_fd);
+    ChatConn *c = i >= 0 ? conn_ref(s->conns[i]) : NULL;
+    pthread_mutex_unlock(&s->clients_mtx);
+    return c;
+}
+
+void chat_server_conn_release(ChatConn *c) {
+    conn_release(c);
+}
+
+void chat_server_touch(ChatConn *c) {
+    if (c) __atomic_store_n(&c->last_seen_ms, mono_ms(), __ATOMIC_RELAXED);
+}
+
+/* o nome pode ser trocado ou liberado assim que o lock é solto, por isso
+ * é copiado ainda sob clients_mtx */
+int chat_server_get_name(ChatServer *s, int client_fd, char *buf, size_t size) {
+    if (!s || !buf || size == 0) return -1;
+    int rc = -1;
+    pthread_mutex_lock(&s->clients_mtx);
+    int i = find_client_locked(s, client_fd);
+    if (i >= 0 && s->conns[i]->name) {
+        snprintf(buf, size, "%s", s->conns[i]->name);
+        rc = 0;
     }
     pthread_mutex_unlock(&s->clients_mtx);
-    return res;
+    return rc;
 }
 
-int chat_server_enqueue_message(ChatServer *s, const char *msg, int sender_fd) {
-    if (!s || !msg) return -1;
-    /* save to history */
-    pthread_mutex_lock(&s->clients_mtx); //obtem lock para modificar history
+/*
+ * Monta o envelope, entrega à fila do broadcaster e salva no histórico;
+ * exige clients_mtx. O push acontece sob o mesmo lock que numera, então a
+ * fila (e cada cliente) recebe as mensagens na ordem das sequências, que é
+ * o que o RESUME e a deduplicação do cliente assumem. Se a fila já foi
+ * fechada a sequência não é consumida. Retorna uma referência ou NULL.
+ */
+static envelope_t *enqueue_locked(ChatServer *s, const char *name, const char *msg, int sender) {
+    envelope_t *env = envelope_create(s->next_seq, name, msg);
+    if (!env) return NULL;
+    TRACE_FLUSH_RECV(env->seq);
+    TRACE(TRACE_ENQUEUE, env->seq);
+    // mq_push adquire sua própria referência
+    if (mq_push(&s->mq, env, sender) != 0) {
+        envelope_unref(env);
+        return NULL;
+    }
+    /* marcado aqui e não em mq_push: as filas dos peers (cluster.c) usam
+     * a mesma estrutura, com a sequência de outro nó */
+    TRACE(TRACE_MQ_PUSH, env->seq);
+    s->next_seq++;
     int idx = (s->history_start + s->history_count) % s->history_size;
     if (s->history_count == s->history_size) {
         /* sobrescreve o mais antigo */
-        free(s->history[s->history_start]);
-        s->history[s->history_start] = strdup(msg);
+        envelope_unref(s->history[s->history_start]);
+        s->history[s->history_start] = envelope_ref(env);
         s->history_start = (s->history_start + 1) % s->history_size;
     } else {
-        s->history[idx] = strdup(msg);
+        s->history[idx] = envelope_ref(env);
         s->history_count++;
     }
+    return env;
+}
+
+int chat_server_enqueue_message(ChatServer *s, const char *msg, int sender_fd) {
+    if (!s || !msg) return -1;
+    /* monta o envelope, enfileira e salva no histórico sob o mesmo lock: o
+     * nome do remetente e a sequência são resolvidos uma vez só, aqui */
+    pthread_mutex_lock(&s->clients_mtx); //obtem lock para ler o nome e modificar history
+    int i = find_client_locked(s, sender_fd);
+    const char *name = i >= 0 ? s->conns[i]->name : NULL;
+    char fallback[32];
+    if (!name) {
+        snprintf(fallback, sizeof(fallback), "cliente%d", sender_fd);
+        name = fallback;
+    }
+    envelope_t *env = enqueue_locked(s, name, msg, sender_fd);
+    if (!env) {
+        pthread_mutex_unlock(&s->clients_mtx);
+        return -1;
+    }
+    /* ainda sob o lock: os peers recebem as mensagens na ordem das sequências */
+    if (s->message_hook) s->message_hook(s->message_hook_arg, env->seq, name, msg);
     pthread_mutex_unlock(&s->clients_mtx); //libera lock apos modificar history
+    envelope_unref(env);
+    return 0;
+}
+
+int chat_server_enqueue_remote(ChatServer *s, const char *name, const char *msg) {
+    if (!s || !name || !msg) return -1;
+    pthread_mutex_lock(&s->clients_mtx);
+    /* remetente -1: nenhum cliente local é excluído do broadcast */
+    envelope_t *env = enqueue_locked(s, name, msg, -1);
+    pthread_mutex_unlock(&s->clients_mtx);
+    if (!env) return -1;
+    envelope_unref(env);
+    return 0;
+}
+
+void chat_server_set_message_hook(ChatServer *s, chat_message_hook_t hook, void *arg) {
+    if (!s) return;
+    pthread_mutex_lock(&s->clients_mtx);
+    s->message_hook = hook;
+    s->message_hook_arg = arg;
+    pthread_mutex_unlock(&s->clients_mtx);
+}
+
+int chat_server_send_private(ChatServer *s, int sender_fd, const char *target_name, const char *msg) {
+    if (!s || !target_name || !msg) return -1;
+    /*
+     * Mensagem privada: o destinatário é resolvido pelo índice de nomes e
+     * recebe o envelope direto pelo seu lock de escrita, sem passar pela
+     * fila do broadcaster nem varrer a lista de clientes. O clients_mtx é
+     * usado só para a busca; o envio acontece fora dele, com uma
+     * referência própria da conexão.
+     */
+    pthread_mutex_lock(&s->clients_mtx);
+    ChatConn *target = conn_ref(name_lookup_locked(s, target_name));
+    int i = find_client_locked(s, sender_fd);
+    char from[128];
+    if (i >= 0 && s->conns[i]->name) {
+        snprintf(from, sizeof(from), "%s -> %s", s->conns[i]->name, target_name);
+    } else {
+        snprintf(from, sizeof(from), "cliente%d -> %s", sender_fd, target_name);
+    }
+    pthread_mutex_unlock(&s->clients_mtx);
+    if (!target) return -1;
 
-    // coloca a mensagem na fila para broadcast; mq_push duplica a string
-    return mq_push(&s->mq, msg, sender_fd);
+    /* mensagens privadas não entram no histórico nem recebem sequência */
+    envelope_t *env = envelope_create(0, from, msg);
+    int rc = -1;
+    if (env) {
+        rc = conn_send(target, env->data, env->len) < 0 ? -1 : 0;
+        if (rc != 0) {
+            tslog_write(LOG_WARN, "Falha ao enviar privada para %s: %s", target_name, strerror(errno));
+        }
+        envelope_unref(env);
+    }
+    conn_release(target);
+    return rc;
+}
+
+int chat_server_send_to(ChatServer *s, int client_fd, const char *data, size_t len) {
+    if (!s || !data) return -1;
+    pthread_mutex_lock(&s->clients_mtx);
+    int i = find_client_locked(s, client_fd);
+    ChatConn *conn = i >= 0 ? conn_ref(s->conns[i]) : NULL;
+    pthread_mutex_unlock(&s->clients_mtx);
+    if (!conn) return -1;
+    int rc = conn_send(conn, data, len) < 0 ? -1 : 0;
+    conn_release(conn);
+    return rc;
 }
 
 // desliga o servidor de chat
@@ -186,57 +658,322 @@ void chat_server_shutdown(ChatServer *s) {
     if (!s) return;
     s->running = 0;
     mq_close(&s->mq);
-    pthread_join(s->broadcaster_tid, NULL);
+    if (!s->broadcaster_joined) {
+        pthread_join(s->broadcaster_tid, NULL);
+        s->broadcaster_joined = 1;
+    }
+    pthread_mutex_lock(&s->wheel_mtx);
+    pthread_cond_signal(&s->reaper_cond);
+    pthread_mutex_unlock(&s->wheel_mtx);
+    pthread_join(s->reaper_tid, NULL);
 
+    /* solta a referência do array: fecha os sockets que ninguém mais usa */
     pthread_mutex_lock(&s->clients_mtx);
     for (int i = 0; i < s->num_clients; i++) {
-        close(s->clients[i]);
+        tw_cancel(&s->conns[i]->idle_timer); // reaper já terminou
+        conn_release(s->conns[i]);
+        s->conns[i] = NULL;
     }
+    s->num_clients = 0;
     pthread_mutex_unlock(&s->clients_mtx);
 
     mq_destroy(&s->mq);
     free(s->clients);
-    for (int i = 0; i < s->max_clients; ++i) {
-        free(s->client_names[i]);
-    }
-    free(s->client_names);
+    free(s->conns);
+    free(s->name_index);
     for (int i = 0; i < s->history_count; i++) {
         int idx = (s->history_start + i) % s->history_size;
-        free(s->history[idx]);
+        envelope_unref(s->history[idx]);
     }
     free(s->history);
     /* destroi todas as primitivas */
     pthread_mutex_destroy(&s->clients_mtx);
+    pthread_cond_destroy(&s->drain_cond);
+    pthread_mutex_destroy(&s->drain_mtx);
+    pthread_cond_destroy(&s->reaper_cond);
+    pthread_mutex_destroy(&s->wheel_mtx);
     sem_destroy(&s->slots);
 }
 
+static int client_count(ChatServer *s) {
+    pthread_mutex_lock(&s->clients_mtx);
+    int n = s->num_clients;
+    pthread_mutex_unlock(&s->clients_mtx);
+    return n;
+}
+
+int chat_server_drain(ChatServer *s, int timeout_ms, int disconnect_clients) {
+    if (!s) return -1;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    /* 1. fila fechada: novos enqueue falham, o broadcaster esvazia o resto */
+    __atomic_store_n(&s->drain_deadline_ms, mono_ms() + timeout_ms, __ATOMIC_RELAXED);
+    mq_close(&s->mq);
+    int timed_out = 0;
+    pthread_mutex_lock(&s->drain_mtx);
+    while (!s->broadcaster_done && !timed_out) {
+        timed_out = pthread_cond_timedwait(&s->drain_cond, &s->drain_mtx, &deadline) == ETIMEDOUT;
+    }
+    pthread_mutex_unlock(&s->drain_mtx);
+    if (timed_out) {
+        /* o envio em curso termina em até CHAT_SEND_TIMEOUT_MS; os seguintes
+         * já não são tentados e o resto da fila é descartado */
+        tslog_write(LOG_WARN, "Drain: prazo estourado com mensagens na fila; descartando restantes");
+        s->running = 0;
+    }
+    /* um drain anterior (handoff que falhou) pode já ter feito o join */
+    if (!s->broadcaster_joined) {
+        pthread_join(s->broadcaster_tid, NULL);
+        s->broadcaster_joined = 1;
+    }
+    if (!disconnect_clients) return timed_out ? -1 : 0;
+
+    /* 2. SHUT_WR: o kernel entrega o que resta no buffer de saída e envia FIN */
+    pthread_mutex_lock(&s->clients_mtx);
+    for (int i = 0; i < s->num_clients; i++) {
+        shutdown(s->clients[i], SHUT_WR);
+    }
+    pthread_mutex_unlock(&s->clients_mtx);
+
+    /* 3. espera os clientes fecharem do lado deles (client_thread vê EOF e remove) */
+    pthread_mutex_lock(&s->drain_mtx);
+    while (!timed_out && client_count(s) > 0) {
+        timed_out = pthread_cond_timedwait(&s->drain_cond, &s->drain_mtx, &deadline) == ETIMEDOUT;
+    }
+    pthread_mutex_unlock(&s->drain_mtx);
+    if (timed_out) {
+        tslog_write(LOG_WARN, "Drain: prazo estourado com %d cliente(s) ainda conectados", client_count(s));
+    }
+    return timed_out ? -1 : 0;
+}
+
+int chat_server_resume(ChatServer *s) {
+    if (!s) return -1;
+    if (!s->broadcaster_joined) return 0; // não houve drain: nada a desfazer
+    __atomic_store_n(&s->drain_deadline_ms, 0, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&s->drain_mtx);
+    s->broadcaster_done = 0;
+    pthread_mutex_unlock(&s->drain_mtx);
+    s->running = 1;
+    mq_reopen(&s->mq);
+    if (start_broadcaster(s, s->broadcaster_cpu) != 0) {
+        mq_close(&s->mq);
+        s->running = 0;
+        pthread_mutex_lock(&s->drain_mtx);
+        s->broadcaster_done = 1;
+        pthread_mutex_unlock(&s->drain_mtx);
+        return -1;
+    }
+    s->broadcaster_joined = 0;
+    return 0;
+}
+
+int chat_server_export_clients(ChatServer *s, int **out_fds, char ***out_names,
+                               char ***out_pending, size_t **out_pending_len,
+                               unsigned long *out_next_seq) {
+    if (!s || !out_fds || !out_names || !out_pending || !out_pending_len) return -1;
+    pthread_mutex_lock(&s->clients_mtx);
+    int n = s->num_clients;
+    int *fds = calloc(n > 0 ? n : 1, sizeof(int));
+    char **names = calloc(n > 0 ? n : 1, sizeof(char*));
+    char **pending = calloc(n > 0 ? n : 1, sizeof(char*));
+    size_t *pending_len = calloc(n > 0 ? n : 1, sizeof(size_t));
+    if (!fds || !names || !pending || !pending_len) {
+        pthread_mutex_unlock(&s->clients_mtx);
+        free(fds);
+        free(names);
+        free(pending);
+        free(pending_len);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        ChatConn *c = s->conns[i];
+        fds[i] = s->clients[i];
+        names[i] = c->name ? strdup(c->name) : NULL;
+        if (c->pending_len > 0 && (pending[i] = malloc(c->pending_len)) != NULL) {
+            memcpy(pending[i], c->pending, c->pending_len);
+            pending_len[i] = c->pending_len;
+        }
+    }
+    if (out_next_seq) *out_next_seq = s->next_seq;
+    pthread_mutex_unlock(&s->clients_mtx);
+    *out_fds = fds;
+    *out_names = names;
+    *out_pending = pending;
+    *out_pending_len = pending_len;
+    return n;
+}
+
+int chat_server_save_pending(ChatServer *s, int client_fd, const char *buf, size_t len) {
+    if (!s || (len > 0 && !buf)) return -1;
+    char *copy = NULL;
+    if (len > 0) {
+        if (!(copy = malloc(len))) return -1;
+        memcpy(copy, buf, len);
+    }
+    pthread_mutex_lock(&s->clients_mtx);
+    int i = find_client_locked(s, client_fd);
+    if (i < 0) {
+        pthread_mutex_unlock(&s->clients_mtx);
+        free(copy);
+        return -1;
+    }
+    free(s->conns[i]->pending);
+    s->conns[i]->pending = copy;
+    s->conns[i]->pending_len = len;
+    pthread_mutex_unlock(&s->clients_mtx);
+    return 0;
+}
+
+int chat_server_export_history(ChatServer *s, envelope_t ***out_envs) {
+    if (!s || !out_envs) return -1;
+    pthread_mutex_lock(&s->clients_mtx);
+    int n = s->history_count;
+    envelope_t **envs = malloc(sizeof(envelope_t*) * (n > 0 ? n : 1));
+    if (!envs) {
+        pthread_mutex_unlock(&s->clients_mtx);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        envs[i] = envelope_ref(s->history[(s->history_start + i) % s->history_size]);
+    }
+    pthread_mutex_unlock(&s->clients_mtx);
+    *out_envs = envs;
+    return n;
+}
+
+void chat_server_import_history(ChatServer *s, envelope_t **envs, int n) {
+    if (!s || !envs || n <= 0) return;
+    /* só as mais novas cabem no anel; as sequências continuam contíguas */
+    int first = n > s->history_size ? n - s->history_size : 0;
+    pthread_mutex_lock(&s->clients_mtx);
+    for (int i = 0; i < s->history_count; i++) {
+        envelope_unref(s->history[(s->history_start + i) % s->history_size]);
+    }
+    s->history_start = 0;
+    s->history_count = 0;
+    for (int i = first; i < n; i++) {
+        s->history[s->history_count++] = envelope_ref(envs[i]);
+    }
+    if (envs[n - 1]->seq >= s->next_seq) s->next_seq = envs[n - 1]->seq + 1;
+    pthread_mutex_unlock(&s->clients_mtx);
+}
+
+void chat_server_resume_seq(ChatServer *s, unsigned long next_seq) {
+    if (!s) return;
+    pthread_mutex_lock(&s->clients_mtx);
+    if (next_seq > s->next_seq) s->next_seq = next_seq;
+    pthread_mutex_unlock(&s->clients_mtx);
+}
+
 int chat_server_send_history(ChatServer *s, int client_fd, int n) {
     if (!s || n <= 0) return 0;
     pthread_mutex_lock(&s->clients_mtx);
+    int ci = find_client_locked(s, client_fd);
+    if (ci < 0) { pthread_mutex_unlock(&s->clients_mtx); return -1; }
+    ChatConn *conn = conn_ref(s->conns[ci]);
     int to_send = n < s->history_count ? n : s->history_count;
     int start_idx = (s->history_start + (s->history_count - to_send)) % s->history_size;
 
-    char **copies = malloc(sizeof(char*) * to_send);
-    if (!copies) { pthread_mutex_unlock(&s->clients_mtx); return -1; }
+    /* apenas referências: o replay reaproveita os bytes já serializados */
+    envelope_t **refs = malloc(sizeof(envelope_t*) * (to_send > 0 ? to_send : 1));
+    if (!refs) {
+        pthread_mutex_unlock(&s->clients_mtx);
+        conn_release(conn);
+        return -1;
+    }
     for (int i = 0; i < to_send; ++i) {
         int idx = (start_idx + i) % s->history_size;
-        copies[i] = s->history[idx] ? strdup(s->history[idx]) : NULL;
-        if (s->history[idx] && !copies[i]) {
-            for (int j = 0; j < i; ++j) free(copies[j]);
-            free(copies);
-            pthread_mutex_unlock(&s->clients_mtx);
-            return -1;
-        }
+        refs[i] = envelope_ref(s->history[idx]);
     }
     pthread_mutex_unlock(&s->clients_mtx);
 
     for (int i = 0; i < to_send; ++i) {
-        if (copies[i]) {
-            send_all(client_fd, copies[i], strlen(copies[i]));
-            send_all(client_fd, "\n", 1);
-            free(copies[i]);
+        if (refs[i]) {
+            conn_send(conn, refs[i]->data, refs[i]->len);
+            envelope_unref(refs[i]);
         }
     }
-    free(copies);
+    free(refs);
+    conn_release(conn);
     return 0;
 }
+
+int chat_server_send_since(ChatServer *s, int client_fd, unsigned long after_seq) {
+    if (!s) return -1;
+    pthread_mutex_lock(&s->clients_mtx);
+    int ci = find_client_locked(s, client_fd);
+    if (ci < 0) { pthread_mutex_unlock(&s->clients_mtx); return -1; }
+    ChatConn *conn = conn_ref(s->conns[ci]);
+
+    /* as sequências no histórico são contíguas (todas vêm de
+     * chat_server_enqueue_message), então a posição de after_seq+1 no anel
+     * sai direto da sequência da mensagem mais antiga */
+    unsigned long first = s->history_count > 0 ? s->history[s->history_start]->seq : s->next_seq;
+    unsigned long from = after_seq + 1;
+    unsigned long lost_from = 0, lost_to = 0;
+    unsigned long last = s->next_seq - 1;
+    int restarted = after_seq >= s->next_seq;
+    if (restarted) {
+        /* o cliente viu sequências que este servidor não numerou (reinício
+         * sem handoff): reenvia o histórico todo, depois do aviso */
+        from = first;
+    } else if (from < first) {
+        lost_from = from;
+        lost_to = first - 1;
+        from = first;
+    }
+    int count = from < s->next_seq ? (int)(s->next_seq - from) : 0;
+    envelope_t **refs = malloc(sizeof(envelope_t*) * (count > 0 ? count : 1));
+    if (!refs) {
+        pthread_mutex_unlock(&s->clients_mtx);
+        conn_release(conn);
+        return -1;
+    }
+    int offset = (int)(from - first);
+    for (int i = 0; i < count; ++i) {
+        refs[i] = envelope_ref(s->history[(s->history_start + offset + i) % s->history_size]);
+    }
+    /* pega o lock de escrita antes de soltar clients_mtx (mesma ordem do
+     * broadcaster): qualquer mensagem com sequência maior que o replay só
+     * pode ser enviada a este cliente depois dele */
+    pthread_mutex_lock(&conn->send_mtx);
+    pthread_mutex_unlock(&s->clients_mtx);
+
+    /* um único write com o intervalo inteiro */
+    char notice[128] = "";
+    if (restarted) {
+        snprintf(notice, sizeof(notice), "*** numeracao reiniciada: #%lu nao existe neste servidor (ultima #%lu)\n",
+                 after_seq, last);
+    } else if (lost_to > 0) {
+        snprintf(notice, sizeof(notice), "*** historico incompleto: mensagens #%lu a #%lu perdidas\n",
+                 lost_from, lost_to);
+    }
+    size_t total = strlen(notice);
+    for (int i = 0; i < count; ++i) total += refs[i]->len;
+    char *buf = malloc(total > 0 ? total : 1);
+    int rc = -1;
+    if (buf) {
+        size_t pos = strlen(notice);
+        memcpy(buf, notice, pos);
+        for (int i = 0; i < count; ++i) {
+            memcpy(buf + pos, refs[i]->data, refs[i]->len);
+            pos += refs[i]->len;
+        }
+        rc = send_all_timeout(conn->fd, buf, total, CHAT_SEND_TIMEOUT_MS) < 0 ? -1 : count;
+        free(buf);
+    }
+    pthread_mutex_unlock(&conn->send_mtx);
+
+    for (int i = 0; i < count; ++i) envelope_unref(refs[i]);
+    free(refs);
+    conn_release(conn);
+    return rc;
+}
@@ -5,33 +5,359 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
 #include "net.h"
 
 #define SERVER_IP "127.0.0.1"
-#define SERVER_PORT 9000
+#define DEFAULT_SERVER_PORT 9000
+
+#define LOAD_DEFAULT_SIZE 64
+#define LOAD_MAX_SIZE 4000      /* cabe na linha máxima do servidor */
+#define LOAD_IDLE_TIMEOUT_S 5   /* desiste de esperar ecos após esse tempo sem progresso */
+#define SEEN_WINDOW 1024        /* sequências recentes lembradas para descartar repetidas */
+
+/* setado pela thread principal antes de fechar o socket por conta própria */
+static volatile int closing = 0;
+/* setado pela thread de recepção quando o servidor fecha a conexão; o
+ * server_closed_pipe acorda a thread principal parada esperando o stdin */
+static volatile int server_closed = 0;
+static int server_closed_pipe[2] = { -1, -1 };
+
+/*
+ * Estado do modo de carga (headless): cada mensagem leva a marca
+ * "[<pid>:<i>]" e o servidor devolve as nossas próprias mensagens (ECHO:1),
+ * então o RTT de i é o tempo entre o envio e a chegada do eco.
+ */
+static int load_mode = 0;
+static int load_total = 0;
+static long long *load_sent_ns = NULL;   /* escrito pela thread principal, lido pela de recepção */
+static long long *load_rtt_us = NULL;    /* -1 = eco ainda não recebido */
+static int load_received = 0;
+static pthread_mutex_t load_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t load_cond = PTHREAD_COND_INITIALIZER;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Sequências recebidas: o replay de RESUME pode repetir mensagens que já
+ * chegaram ao vivo. seen[] guarda as últimas SEEN_WINDOW sequências vistas
+ * (posição seq % SEEN_WINDOW); tudo até resume_base já foi visto numa
+ * conexão anterior.
+ */
+static unsigned long last_seq = 0;
+static unsigned long resume_base = 0;
+static unsigned long seen[SEEN_WINDOW];
+
+/* extrai N de um broadcast "[HH:MM:SS] #N nome: ..."; 0 para as outras
+ * linhas (privadas e avisos não têm sequência) */
+static unsigned long parse_seq(const char *line) {
+    if (strlen(line) < 14 || line[0] != '[' || line[3] != ':' || line[6] != ':' ||
+        strncmp(line + 9, "] #", 3) != 0) {
+        return 0;
+    }
+    char *end;
+    unsigned long seq = strtoul(line + 12, &end, 10);
+    return (end > line + 12 && *end == ' ') ? seq : 0;
+}
+
+/* 1 se a mensagem já foi exibida (e deve ser descartada) */
+static int already_seen(unsigned long seq) {
+    if (seq == 0) return 0;
+    if (seq <= resume_base) return 1;
+    if (seen[seq % SEEN_WINDOW] == seq) return 1;
+    if (last_seq >= SEEN_WINDOW && seq <= last_seq - SEEN_WINDOW) return 1; // antiga demais para a janela
+    seen[seq % SEEN_WINDOW] = seq;
+    if (seq > last_seq) last_seq = seq;
+    return 0;
+}
+
+/* a thread de recepção também escreve (PONG): serializa os envios */
+static pthread_mutex_t send_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static ssize_t send_line(int sock, const char *buf, size_t len) {
+    pthread_mutex_lock(&send_mtx);
+    ssize_t rc = send_all(sock, buf, len);
+    pthread_mutex_unlock(&send_mtx);
+    return rc;
+}
+
+/* trata uma linha completa vinda do servidor (sem o '\n') */
+static void handle_server_line(int sock, const char *line) {
+    /* heartbeat do servidor: responder mantém a conexão viva quando ociosa */
+    if (strcmp(line, "PING") == 0) {
+        send_line(sock, "PONG\n", 5);
+        return;
+    }
+    if (strcmp(line, "PONG") == 0) return;
+    if (strncmp(line, "*** numeracao reiniciada", 24) == 0) {
+        /* o servidor recomeçou a numeração: o replay que vem a seguir é
+         * todo novo, nada até resume_base pode ser descartado */
+        resume_base = 0;
+        last_seq = 0;
+        memset(seen, 0, sizeof(seen));
+    }
+    if (!load_mode) {
+        if (already_seen(parse_seq(line))) return;
+        printf("%s\n", line); // Exibe qualquer mensagem recebida do servidor
+        fflush(stdout);
+        tslog_write(LOG_INFO, "Broadcast recebido: %s", line);
+        return;
+    }
+    char tag[32];
+    snprintf(tag, sizeof(tag), "[%d:", (int)getpid());
+    const char *p = strstr(line, tag);
+    if (!p) return; // mensagem de outro cliente
+    int i = atoi(p + strlen(tag));
+    if (i < 0 || i >= load_total) return;
+    long long sent = __atomic_load_n(&load_sent_ns[i], __ATOMIC_ACQUIRE);
+    long long rtt = (now_ns() - sent) / 1000;
+    pthread_mutex_lock(&load_mtx);
+    if (load_rtt_us[i] < 0) {
+        load_rtt_us[i] = rtt;
+        load_received++;
+        pthread_cond_signal(&load_cond);
+    }
+    pthread_mutex_unlock(&load_mtx);
+    tslog_write(LOG_INFO, "RTT msg=%d us=%lld", i, rtt);
+}
 
 // Thread para receber mensagens do servidor
 void *receive_thread(void *arg) {
     int sock = *(int *)arg;
     free(arg);
-    char buffer[256];
+    size_t cap = 4096, used = 0;
+    char *buffer = malloc(cap);
     ssize_t len;
     /*
-     * Thread de recepção: imprime qualquer mensagem enviada pelo servidor.
-     * Usa um buffer de tamanho fixo (256 bytes); mensagens maiores serão
-     * truncadas.
+     * Thread de recepção: separa o fluxo do servidor em linhas ('\n').
+     * Um recv pode trazer várias mensagens ou parte de uma; o que sobra
+     * fica no buffer, que cresce se uma linha não couber.
      */
-    while ((len = recv(sock, buffer, sizeof(buffer)-1, 0)) > 0) {
-        buffer[len] = '\0';
-        printf("%s\n", buffer); // Exibe qualquer mensagem recebida do servidor
-        tslog_write(LOG_INFO, "Broadcast recebido: %s", buffer);
+    while (buffer && (len = recv(sock, buffer + used, cap - used - 1, 0)) > 0) {
+        used += (size_t)len;
+        size_t start = 0;
+        char *nl;
+        while ((nl = memchr(buffer + start, '\n', used - start)) != NULL) {
+            *nl = '\0';
+            handle_server_line(sock, buffer + start);
+            start = (size_t)(nl - buffer) + 1;
+        }
+        memmove(buffer, buffer + start, used - start);
+        used -= start;
+        if (used == cap - 1) {
+            char *bigger = realloc(buffer, cap * 2);
+            if (!bigger) break;
+            buffer = bigger;
+            cap *= 2;
+        }
+    }
+    free(buffer);
+    /* servidor encerrou a conexão (ex.: drain no desligamento): avisa a
+     * thread principal, que encerra pelo caminho normal */
+    if (!closing) {
+        printf("Conexao encerrada pelo servidor.\n");
+        fflush(stdout);
+        tslog_write(LOG_INFO, "Conexao encerrada pelo servidor (ultima sequencia: %lu)", last_seq);
+        shutdown(sock, SHUT_RDWR); /* envios seguintes falham na hora */
+        pthread_mutex_lock(&load_mtx);
+        server_closed = 1;
+        pthread_cond_signal(&load_cond); // run_load para de esperar ecos
+        pthread_mutex_unlock(&load_mtx);
+        char c = 1;
+        ssize_t r = write(server_closed_pipe[1], &c, 1);
+        (void)r;
     }
     return NULL;
 }
 
+/* espera uma linha no stdin; 0 se o servidor fechou a conexão antes */
+static int wait_input(void) {
+    struct pollfd pfds[2] = {
+        { STDIN_FILENO, POLLIN, 0 },
+        { server_closed_pipe[0], POLLIN, 0 },
+    };
+    while (poll(pfds, 2, -1) < 0) {
+        if (errno != EINTR) return 1; // deixa o fgets decidir
+    }
+    return (pfds[1].revents & POLLIN) ? 0 : 1;
+}
+
+/* lê as mensagens do roteiro (uma por linha) */
+static char **load_script(const char *path, int *out_count) {
+    FILE *f = fopen(path, "r");
+    if (!f) return NULL;
+    int cap = 64, n = 0;
+    char **msgs = malloc(sizeof(char*) * cap);
+    char *line = NULL;
+    size_t lcap = 0;
+    ssize_t l;
+    while (msgs && (l = getline(&line, &lcap, f)) >= 0) {
+        while (l > 0 && (line[l-1] == '\n' || line[l-1] == '\r')) line[--l] = '\0';
+        if (l == 0) continue;
+        if (l > LOAD_MAX_SIZE) line[LOAD_MAX_SIZE] = '\0';
+        if (n == cap) {
+            char **bigger = realloc(msgs, sizeof(char*) * cap * 2);
+            if (!bigger) break;
+            msgs = bigger;
+            cap *= 2;
+        }
+        msgs[n++] = strdup(line);
+    }
+    free(line);
+    fclose(f);
+    *out_count = n;
+    return msgs;
+}
+
+/* gera count mensagens de size bytes */
+static char **generate_messages(int count, int size) {
+    char **msgs = malloc(sizeof(char*) * (count > 0 ? count : 1));
+    if (!msgs) return NULL;
+    for (int i = 0; i < count; i++) {
+        msgs[i] = malloc((size_t)size + 1);
+        if (!msgs[i]) return NULL;
+        int n = snprintf(msgs[i], (size_t)size + 1, "mensagem de carga %d ", i);
+        if (n < size) memset(msgs[i] + n, 'x', (size_t)(size - n));
+        msgs[i][size] = '\0';
+    }
+    return msgs;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Modo de carga: envia todas as mensagens em pipeline (sem esperar
+ * resposta nem dormir) e depois espera os ecos, registrando o RTT de
+ * cada mensagem no log e um resumo ao final.
+ */
+static int run_load(int sock, char **msgs, int count) {
+    load_total = count;
+    load_sent_ns = calloc(count > 0 ? count : 1, sizeof(long long));
+    load_rtt_us = malloc(sizeof(long long) * (count > 0 ? count : 1));
+    if (!load_sent_ns || !load_rtt_us) return -1;
+    for (int i = 0; i < count; i++) load_rtt_us[i] = -1;
+
+    /* mensagens pequenas em sequência: sem Nagle para não medir o atraso dele */
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (send_line(sock, "ECHO:1\n", 7) < 0) return -1;
+
+    char line[LOAD_MAX_SIZE + 64];
+    long long t0 = now_ns();
+    for (int i = 0; i < count; i++) {
+        int n = snprintf(line, sizeof(line), "[%d:%d] %s\n", (int)getpid(), i, msgs[i]);
+        __atomic_store_n(&load_sent_ns[i], now_ns(), __ATOMIC_RELEASE);
+        if (send_line(sock, line, (size_t)n) < 0) {
+            tslog_write(LOG_ERROR, "Falha no send da mensagem %d: %s", i, strerror(errno));
+            return -1;
+        }
+    }
+    long long send_us = (now_ns() - t0) / 1000;
+    tslog_write(LOG_INFO, "Carga: %d mensagens enviadas em %lld us", count, send_us);
+
+    pthread_mutex_lock(&load_mtx);
+    int last = -1;
+    while (load_received < count && load_received != last && !server_closed) {
+        last = load_received;
+        struct timespec dl;
+        clock_gettime(CLOCK_REALTIME, &dl);
+        dl.tv_sec += LOAD_IDLE_TIMEOUT_S;
+        while (load_received == last && !server_closed &&
+               pthread_cond_timedwait(&load_cond, &load_mtx, &dl) != ETIMEDOUT) {
+        }
+    }
+    int got = 0;
+    long long *sorted = malloc(sizeof(long long) * (count > 0 ? count : 1));
+    for (int i = 0; sorted && i < count; i++) {
+        if (load_rtt_us[i] >= 0) sorted[got++] = load_rtt_us[i];
+    }
+    pthread_mutex_unlock(&load_mtx);
+    long long total_us = (now_ns() - t0) / 1000;
+
+    if (sorted && got > 0) {
+        qsort(sorted, got, sizeof(long long), cmp_ll);
+        long long sum = 0;
+        for (int i = 0; i < got; i++) sum += sorted[i];
+        int p99 = (got * 99 + 99) / 100 - 1; /* percentil por posto mais próximo */
+        printf("Carga: %d/%d ecos em %lld us | RTT us: min=%lld media=%lld p50=%lld p99=%lld max=%lld\n",
+               got, count, total_us, sorted[0], sum / got, sorted[got / 2],
+               sorted[p99], sorted[got - 1]);
+        tslog_write(LOG_INFO, "Carga: %d/%d ecos, RTT us min=%lld media=%lld p50=%lld p99=%lld max=%lld",
+                    got, count, sorted[0], sum / got, sorted[got / 2],
+                    sorted[p99], sorted[got - 1]);
+    } else {
+        printf("Carga: nenhum eco recebido de %d mensagens\n", count);
+        tslog_write(LOG_WARN, "Carga: nenhum eco recebido de %d mensagens", count);
+    }
+    free(sorted);
+    return got == count ? 0 : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Uso: %s [nome] [--port N] [--resume SEQ] [--script ARQUIVO | --count N [--size BYTES]]\n", prog);
+}
+
 int main(int argc, char **argv) {
+    const char *name = NULL;
+    const char *script = NULL;
+    int count = 0, size = LOAD_DEFAULT_SIZE;
+    int port = DEFAULT_SERVER_PORT;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc) {
+            script = argv[++i];
+        } else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc) {
+            resume_base = strtoul(argv[++i], NULL, 10);
+            last_seq = resume_base;
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            size = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && !name) {
+            name = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (size < 1 || size > LOAD_MAX_SIZE || count < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    load_mode = script != NULL || count > 0;
+
+    char **msgs = NULL;
+    if (script) {
+        msgs = load_script(script, &count);
+        if (!msgs) {
+            perror("Falha ao ler roteiro");
+            return 1;
+        }
+    } else if (load_mode) {
+        msgs = generate_messages(count, size);
+        if (!msgs) {
+            perror("malloc");
+            return 1;
+        }
+    }
+
+    /* com a conexão fechada pelo servidor, um send em andamento deve falhar
+     * com EPIPE em vez de matar o processo antes do encerramento normal */
+    signal(SIGPIPE, SIG_IGN);
+
     char logname[64];
     snprintf(logname, sizeof(logname), "client_log_%d.txt", getpid());
     tslog_init(logname, 0);
@@ -44,8 +370,7 @@ int main(int argc, char **argv) {
     }
     struct sockaddr_in server_addr = {0};
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
-    inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr);
+    server_addr.sin_port = htons(port);
     if (inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr) != 1) {
         fprintf(stderr, "Endereco IP invalido: %s\n", SERVER_IP);
         close(sock);
@@ -60,8 +385,7 @@ int main(int argc, char **argv) {
     }
 
     /* Se o usuário passou um nome como argumento, envie como primeira mensagem usando o prefixo NAME: */
-    if (argc >= 2) {
-        const char *name = argv[1];
+    if (name) {
         char name_msg[256];
         /* enviar NAME com newline para delimitar claramente o campo */
         snprintf(name_msg, sizeof(name_msg), "NAME:%s\n", name);
@@ -73,8 +397,26 @@ int main(int argc, char **argv) {
         }
     }
 
+    /* retomada: pede só as mensagens posteriores à última vista na conexão anterior */
+    if (resume_base > 0) {
+        char resume_msg[64];
+        int n = snprintf(resume_msg, sizeof(resume_msg), "RESUME:%lu\n", resume_base);
+        if (send_all(sock, resume_msg, (size_t)n) < 0) {
+            tslog_write(LOG_WARN, "Falha ao pedir retomada a partir de #%lu", resume_base);
+        } else {
+            tslog_write(LOG_INFO, "Retomada pedida a partir de #%lu", resume_base);
+        }
+    }
+
+    if (pipe(server_closed_pipe) != 0) {
+        perror("pipe");
+        close(sock);
+        tslog_close();
+        return 1;
+    }
+
     pthread_t tid;
-    tslog_write(LOG_INFO, "Cliente conectado ao servidor %s:%d (thread principal: %lu)", SERVER_IP, SERVER_PORT, pthread_self());
+    tslog_write(LOG_INFO, "Cliente conectado ao servidor %s:%d (thread principal: %lu)", SERVER_IP, port, pthread_self());
     int *psock = malloc(sizeof(int));
     if (!psock) {
         perror("malloc");
@@ -91,9 +433,24 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    if (load_mode) {
+        int rc = run_load(sock, msgs, count);
+        for (int i = 0; i < count; i++) free(msgs[i]);
+        free(msgs);
+        closing = 1;
+        shutdown(sock, SHUT_RDWR); // acorda o recv da thread de recepção
+        pthread_join(tid, NULL);
+        close(sock);
+        tslog_close();
+        return rc == 0 ? 0 : 1;
+    }
+
+    /* sem buffer no stdin: o poll de wait_input vê tudo o que o fgets
+     * ainda tem para ler */
+    setvbuf(stdin, NULL, _IONBF, 0);
     char msg[256];
     printf("Digite sua mensagem:\n");
-    while (fgets(msg, sizeof(msg), stdin)) {
+    while (wait_input() && fgets(msg, sizeof(msg), stdin)) {
         size_t len = strlen(msg);
         if (len > 0 && msg[len - 1] == '\n') {
             msg[len - 1] = '\0';
@@ -102,13 +459,11 @@ int main(int argc, char **argv) {
             tslog_write(LOG_INFO, "Cliente solicitado /quit");
             break;
         }
-    /*
-     * Envio: usa-se uma única chamada send(). Em casos raros send()
-     * pode escrever parcialmente; uma implementação robusta deveria
-     * iterar até enviar tudo ou ocorrer um erro (ver sugestão
-     * send_all nas notas do checkpoint).
-     */
-        if (send_all(sock, msg, strlen(msg)) < 0) {
+        /* cada mensagem termina em '\n': é assim que o servidor separa
+         * mensagens que chegam juntas no mesmo recv */
+        len = strlen(msg);
+        msg[len] = '\n';
+        if (send_line(sock, msg, len + 1) < 0) {
             perror("send");
             tslog_write(LOG_ERROR, "Falha no send do cliente %d: %s", sock, strerror(errno));
             break;
@@ -117,11 +472,20 @@ int main(int argc, char **argv) {
 
         /* pequena pausa usada em testes para aumentar a chance de ver o
          * broadcast antes do cliente encerrar; é opcional e pode ser
-         * removida quando os testes estiverem estáveis. */
+         * removida quando os testes estiverem estáveis. O modo de carga
+         * (--script/--count) não usa esta pausa. */
         sleep(1);
     }
 
+    closing = 1;
+    shutdown(sock, SHUT_RDWR); // acorda o recv da thread de recepção
+    pthread_join(tid, NULL);
     close(sock);
+    close(server_closed_pipe[0]);
+    close(server_closed_pipe[1]);
+    /* para retomar depois com --resume */
+    printf("Ultima sequencia recebida: %lu\n", last_seq);
+    tslog_write(LOG_INFO, "Ultima sequencia recebida: %lu", last_seq);
     tslog_close();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,492 @@
+#include "cluster.h"
+#include "tslog.h"
+#include "net.h"
+#include "scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define CLUSTER_MAX_FRAME 8192
+
+static unsigned long long realtime_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+}
+
+/* ---- deduplicação por origem+seq (exige c->mtx) ---- */
+
+static int seen_bit(cluster_origin_t *o, unsigned long seq) {
+    unsigned long pos = seq % CLUSTER_DEDUP_WINDOW;
+    return (o->bits[pos / 64] >> (pos % 64)) & 1ULL;
+}
+
+static void set_bit(cluster_origin_t *o, unsigned long seq, int on) {
+    unsigned long pos = seq % CLUSTER_DEDUP_WINDOW;
+    if (on) o->bits[pos / 64] |= 1ULL << (pos % 64);
+    else o->bits[pos / 64] &= ~(1ULL << (pos % 64));
+}
+
+/* 1 se a mensagem é nova (e a marca como vista), 0 se é duplicata/antiga */
+static int dedup_accept_locked(Cluster *c, int origin, unsigned long long epoch, unsigned long seq) {
+    if (origin <= 0 || origin >= CLUSTER_MAX_NODES || origin == c->node_id || seq == 0) return 0;
+    cluster_origin_t *o = &c->origins[origin];
+    if (epoch < o->epoch) return 0; // de um processo anterior daquela origem (handle_frame já recusou épocas no futuro)
+    if (epoch > o->epoch) {
+        /* a origem reiniciou: a numeração recomeça */
+        memset(o, 0, sizeof(*o));
+        o->epoch = epoch;
+    }
+    if (seq > o->max_seq) {
+        /* a janela anda: as posições reaproveitadas ainda não foram vistas */
+        if (seq - o->max_seq >= CLUSTER_DEDUP_WINDOW) {
+            memset(o->bits, 0, sizeof(o->bits));
+        } else {
+            for (unsigned long s = o->max_seq + 1; s <= seq; s++) set_bit(o, s, 0);
+        }
+        o->max_seq = seq;
+        set_bit(o, seq, 1);
+        return 1;
+    }
+    if (o->max_seq - seq >= CLUSTER_DEDUP_WINDOW) return 0; // fora da janela: trata como repetida
+    if (seen_bit(o, seq)) return 0;
+    set_bit(o, seq, 1);
+    return 1;
+}
+
+/* ---- envio para peers ---- */
+
+static void *peer_writer(void *arg) {
+    cluster_peer_t *p = (cluster_peer_t *)arg;
+    char *batch = malloc(CLUSTER_BATCH_BYTES);
+    envelope_t *env;
+    int sender, dead = (batch == NULL);
+    /*
+     * Thread de envio do peer: espera o primeiro frame e junta no mesmo
+     * write todos os que já estiverem na fila (até CLUSTER_BATCH_BYTES),
+     * reduzindo syscalls quando o tráfego aperta. Se a conexão falhar,
+     * continua só descartando até a fila ser fechada.
+     */
+    while (mq_pop(&p->outq, &env, &sender) == 0) {
+        size_t used = 0;
+        do {
+            if (!dead) {
+                if (used + env->len > CLUSTER_BATCH_BYTES) {
+                    if (used > 0 && send_all(p->fd, batch, used) < 0) dead = 1;
+                    used = 0;
+                }
+                if (!dead && env->len > CLUSTER_BATCH_BYTES) {
+                    if (send_all(p->fd, env->data, env->len) < 0) dead = 1;
+                } else if (!dead) {
+                    memcpy(batch + used, env->data, env->len);
+                    used += env->len;
+                }
+            }
+            envelope_unref(env);
+        } while (mq_try_pop(&p->outq, &env, &sender) == 0);
+        if (!dead && used > 0 && send_all(p->fd, batch, used) < 0) dead = 1;
+        if (dead && p->fd >= 0) {
+            /* derruba a conexão: a thread de leitura vê o erro e desregistra o peer */
+            shutdown(p->fd, SHUT_RDWR);
+        }
+    }
+    free(batch);
+    return NULL;
+}
+
+static cluster_peer_t *peer_register(Cluster *c, int fd, int remote_id) {
+    /* a fila de saída é alinhada em linha de cache: calloc não garante isso */
+    cluster_peer_t *p = NULL;
+    if (posix_memalign((void **)&p, CACHE_LINE, sizeof(cluster_peer_t)) != 0) return NULL;
+    memset(p, 0, sizeof(cluster_peer_t));
+    p->fd = fd;
+    p->remote_id = remote_id;
+    if (mq_init(&p->outq) != 0) {
+        free(p);
+        return NULL;
+    }
+    struct timeval tv = { CHAT_SEND_TIMEOUT_MS / 1000, (CHAT_SEND_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (pthread_create(&p->writer_tid, NULL, peer_writer, p) != 0) {
+        mq_destroy(&p->outq);
+        free(p);
+        return NULL;
+    }
+    pthread_mutex_lock(&c->mtx);
+    if (c->stopping || c->num_peers >= CLUSTER_MAX_PEERS) {
+        pthread_mutex_unlock(&c->mtx);
+        mq_close(&p->outq);
+        pthread_join(p->writer_tid, NULL);
+        mq_destroy(&p->outq);
+        free(p);
+        return NULL;
+    }
+    c->peers[c->num_peers++] = p;
+    pthread_mutex_unlock(&c->mtx);
+    tslog_write(LOG_INFO, "Peer conectado (fd=%d, no=%d), peers=%d", fd, remote_id, c->num_peers);
+    return p;
+}
+
+static void peer_unregister(Cluster *c, cluster_peer_t *p) {
+    pthread_mutex_lock(&c->mtx);
+    for (int i = 0; i < c->num_peers; i++) {
+        if (c->peers[i] == p) {
+            c->peers[i] = c->peers[--c->num_peers];
+            break;
+        }
+    }
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->mtx);
+    mq_close(&p->outq);
+    pthread_join(p->writer_tid, NULL);
+    mq_destroy(&p->outq);
+    tslog_write(LOG_INFO, "Peer desconectado (fd=%d, no=%d)", p->fd, p->remote_id);
+    free(p);
+}
+
+/* gancho do ChatServer: chamado sob clients_mtx, na ordem das sequências */
+static void forward_local(void *arg, unsigned long seq, const char *name, const char *text) {
+    Cluster *c = (Cluster *)arg;
+    char frame[CLUSTER_MAX_FRAME];
+    int n = snprintf(frame, sizeof(frame), "FWD %d %llu %lu ", c->node_id, c->epoch, seq);
+    /* o nome vai até o primeiro tab: tabs no nome viram espaço */
+    for (const char *p = name; *p && n < (int)sizeof(frame) - 2; p++) {
+        frame[n++] = (*p == '\t') ? ' ' : *p;
+    }
+    n += snprintf(frame + n, sizeof(frame) - n, "\t%s", text);
+    if (n > (int)sizeof(frame) - 2) n = (int)sizeof(frame) - 2;
+    while (n > 0 && (frame[n-1] == '\n' || frame[n-1] == '\r')) n--;
+    frame[n++] = '\n';
+
+    /* um único envelope compartilhado por todas as filas de peers */
+    envelope_t *env = envelope_from_bytes(seq, frame, (size_t)n);
+    if (!env) return;
+    pthread_mutex_lock(&c->mtx);
+    for (int i = 0; i < c->num_peers; i++) {
+        mq_push(&c->peers[i]->outq, env, 0);
+    }
+    pthread_mutex_unlock(&c->mtx);
+    envelope_unref(env);
+}
+
+/* ---- recepção de peers ---- */
+
+/* trata uma linha "FWD ..." (sem o '\n', que fica em line[len]) */
+static void handle_frame(Cluster *c, cluster_peer_t *from, char *line, size_t len) {
+    int origin, off = 0;
+    unsigned long long epoch;
+    unsigned long seq;
+    if (sscanf(line, "FWD %d %llu %lu %n", &origin, &epoch, &seq, &off) != 3 || off == 0) {
+        tslog_write(LOG_WARN, "Peer fd=%d enviou linha invalida", from->fd);
+        return;
+    }
+    /* o texto vai aos clientes como o de um cliente local: mesma validação */
+    if (scan_validate(line + off, len - (size_t)off) != 0) {
+        tslog_write(LOG_WARN, "Peer fd=%d enviou texto invalido (origem no=%d)", from->fd, origin);
+        return;
+    }
+    /* uma época no futuro travaria a origem verdadeira para sempre (as
+     * mensagens dela pareceriam de um processo anterior) */
+    if (epoch == 0 || epoch > realtime_ns() + (unsigned long long)CLUSTER_MAX_SKEW_MS * 1000000ULL) {
+        tslog_write(LOG_WARN, "Peer fd=%d enviou epoca no futuro (origem no=%d)", from->fd, origin);
+        return;
+    }
+    pthread_mutex_lock(&c->mtx);
+    int fresh = dedup_accept_locked(c, origin, epoch, seq);
+    envelope_t *env = NULL;
+    if (fresh && c->num_peers > 1) {
+        /* repassa o mesmo frame aos outros peers (topologias que não são malha completa) */
+        line[len] = '\n';
+        env = envelope_from_bytes(seq, line, len + 1);
+        line[len] = '\0';
+        for (int i = 0; env && i < c->num_peers; i++) {
+            if (c->peers[i] != from) mq_push(&c->peers[i]->outq, env, 0);
+        }
+    }
+    pthread_mutex_unlock(&c->mtx);
+    envelope_unref(env);
+    if (!fresh) return;
+
+    char *name = line + off;
+    char *tab = strchr(name, '\t');
+    if (!tab) return;
+    *tab = '\0';
+    char display[160];
+    snprintf(display, sizeof(display), "%s@no%d", name, origin);
+    chat_server_enqueue_remote(c->chat, display, tab + 1);
+}
+
+/* lê frames do peer até a conexão cair */
+static void peer_read_loop(Cluster *c, cluster_peer_t *p, const char *pending, size_t pending_len) {
+    char *buffer = malloc(CLUSTER_MAX_FRAME + 1);
+    if (!buffer) return;
+    size_t used = pending_len < CLUSTER_MAX_FRAME ? pending_len : CLUSTER_MAX_FRAME;
+    if (used > 0) memcpy(buffer, pending, used);
+    ssize_t len = (ssize_t)used;
+    do {
+        size_t start = 0, nl;
+        while ((nl = start + scan_delim(buffer + start, used - start)) < used) {
+            buffer[nl] = '\0';
+            handle_frame(c, p, buffer + start, nl - start);
+            start = nl + 1;
+        }
+        if (start == 0 && used == CLUSTER_MAX_FRAME) {
+            tslog_write(LOG_WARN, "Peer fd=%d: frame maior que %d bytes descartado", p->fd, CLUSTER_MAX_FRAME);
+            start = used;
+        }
+        memmove(buffer, buffer + start, used - start);
+        used -= start;
+        len = recv(p->fd, buffer + used, CLUSTER_MAX_FRAME - used, 0);
+        if (len > 0) used += (size_t)len;
+    } while (len > 0 || (len < 0 && errno == EINTR));
+    free(buffer);
+}
+
+/* 1 se o endereço remoto de fd foi configurado como peer */
+static int peer_allowed(Cluster *c, int fd) {
+    struct sockaddr_in addr;
+    socklen_t alen = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr *)&addr, &alen) != 0 || addr.sin_family != AF_INET) return 0;
+    int ok = 0;
+    pthread_mutex_lock(&c->mtx);
+    for (int i = 0; i < c->num_allowed && !ok; i++) {
+        ok = c->allowed[i].s_addr == addr.sin_addr.s_addr;
+    }
+    pthread_mutex_unlock(&c->mtx);
+    if (!ok) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+        tslog_write(LOG_WARN, "Conexao %d de %s se apresentou como peer sem estar configurada; recusada", fd, ip);
+    }
+    return ok;
+}
+
+void cluster_serve_peer(Cluster *c, int fd, const char *hello, const char *pending, size_t pending_len) {
+    int remote_id = 0;
+    unsigned long long remote_epoch = 0;
+    if (!c || sscanf(hello, "PEER:%d %llu", &remote_id, &remote_epoch) < 1) return;
+    if (!peer_allowed(c, fd)) return;
+    cluster_peer_t *p = peer_register(c, fd, remote_id);
+    if (!p) {
+        tslog_write(LOG_WARN, "Peer no=%d recusado (limite de peers ou encerrando)", remote_id);
+        return;
+    }
+    peer_read_loop(c, p, pending, pending_len);
+    peer_unregister(c, p);
+}
+
+/* ---- conexões de saída ---- */
+
+/* connect não bloqueante limitado a CLUSTER_RETRY_MS; desiste se o
+ * cluster_shutdown escrever em wake_pipe. Retorna o fd (bloqueante) ou -1 */
+static int dial(Cluster *c, const char *host, int port) {
+    struct addrinfo hints = {0}, *res = NULL;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char port_str[16];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    if (getaddrinfo(host, port_str, &hints, &res) != 0) return -1;
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    int flags = fd >= 0 ? fcntl(fd, F_GETFL) : -1;
+    int rc = -1;
+    if (flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0) {
+        rc = connect(fd, res->ai_addr, res->ai_addrlen);
+        if (rc != 0 && errno == EINPROGRESS) {
+            struct pollfd pfds[2] = {
+                { fd, POLLOUT, 0 },
+                { c->wake_pipe[0], POLLIN, 0 },
+            };
+            int n;
+            do {
+                n = poll(pfds, 2, CLUSTER_RETRY_MS);
+            } while (n < 0 && errno == EINTR);
+            int err = 0;
+            socklen_t elen = sizeof(err);
+            if (n > 0 && !(pfds[1].revents & POLLIN) && (pfds[0].revents & (POLLOUT | POLLERR | POLLHUP)) &&
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &elen) == 0 && err == 0) {
+                rc = 0;
+            }
+        }
+        /* o link usa sends e recvs bloqueantes */
+        if (rc == 0 && fcntl(fd, F_SETFL, flags) != 0) rc = -1;
+    }
+    if (rc != 0 && fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static void *dialer_func(void *arg) {
+    cluster_dialer_t *d = (cluster_dialer_t *)arg;
+    Cluster *c = d->cluster;
+    /*
+     * Thread de conexão: mantém um link com o peer configurado. Enquanto
+     * conectado, esta thread é a leitora do link; se cair, tenta de novo a
+     * cada CLUSTER_RETRY_MS até o cluster ser encerrado.
+     */
+    pthread_mutex_lock(&c->mtx);
+    while (!c->stopping) {
+        pthread_mutex_unlock(&c->mtx);
+        int fd = dial(c, d->host, d->port);
+        cluster_peer_t *p = NULL;
+        if (fd >= 0) {
+            char hello[64];
+            int n = snprintf(hello, sizeof(hello), "PEER:%d %llu\n", c->node_id, c->epoch);
+            if (send_all(fd, hello, (size_t)n) == n) {
+                pthread_mutex_lock(&c->mtx);
+                d->fd = fd;
+                pthread_mutex_unlock(&c->mtx);
+                p = peer_register(c, fd, 0);
+            }
+        }
+        if (p) {
+            peer_read_loop(c, p, NULL, 0);
+            peer_unregister(c, p);
+        }
+        pthread_mutex_lock(&c->mtx);
+        d->fd = -1;
+        if (fd >= 0) close(fd);
+        if (c->stopping) break;
+        /* espera antes de tentar de novo (acorda cedo no cluster_shutdown) */
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += CLUSTER_RETRY_MS / 1000;
+        deadline.tv_nsec += (long)(CLUSTER_RETRY_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&c->cond, &c->mtx, &deadline);
+    }
+    pthread_mutex_unlock(&c->mtx);
+    return NULL;
+}
+
+/* ---- ciclo de vida ---- */
+
+int cluster_init(Cluster *c, ChatServer *chat, int node_id) {
+    if (!c || !chat || node_id <= 0 || node_id >= CLUSTER_MAX_NODES) return -1;
+    memset(c, 0, sizeof(*c));
+    c->chat = chat;
+    c->node_id = node_id;
+    /* em ns: um reinício no mesmo segundo ainda tem época maior */
+    c->epoch = realtime_ns();
+    if (pipe(c->wake_pipe) != 0) return -1;
+    if (pthread_mutex_init(&c->mtx, NULL) != 0) {
+        close(c->wake_pipe[0]);
+        close(c->wake_pipe[1]);
+        return -1;
+    }
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    if (pthread_cond_init(&c->cond, &cattr) != 0) {
+        pthread_condattr_destroy(&cattr);
+        pthread_mutex_destroy(&c->mtx);
+        close(c->wake_pipe[0]);
+        close(c->wake_pipe[1]);
+        return -1;
+    }
+    pthread_condattr_destroy(&cattr);
+    chat_server_set_message_hook(chat, forward_local, c);
+    return 0;
+}
+
+int cluster_allow_peer(Cluster *c, const char *host) {
+    if (!c || !host) return -1;
+    struct addrinfo hints = {0}, *res = NULL;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) return -1;
+    int rc = 0;
+    pthread_mutex_lock(&c->mtx);
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        struct in_addr a = ((struct sockaddr_in *)ai->ai_addr)->sin_addr;
+        int known = 0;
+        for (int i = 0; i < c->num_allowed && !known; i++) known = c->allowed[i].s_addr == a.s_addr;
+        if (known) continue;
+        if (c->num_allowed >= CLUSTER_MAX_ALLOWED) {
+            rc = -1;
+            break;
+        }
+        c->allowed[c->num_allowed++] = a;
+    }
+    pthread_mutex_unlock(&c->mtx);
+    freeaddrinfo(res);
+    return rc;
+}
+
+int cluster_add_peer(Cluster *c, const char *host, int port) {
+    if (!c || !host || port <= 0) return -1;
+    /* se o peer também tiver este nó em --peer, ele conecta aqui */
+    if (cluster_allow_peer(c, host) != 0) return -1;
+    cluster_dialer_t *d = calloc(1, sizeof(cluster_dialer_t));
+    if (!d) return -1;
+    d->cluster = c;
+    snprintf(d->host, sizeof(d->host), "%s", host);
+    d->port = port;
+    d->fd = -1;
+    pthread_mutex_lock(&c->mtx);
+    if (c->num_dialers >= CLUSTER_MAX_PEERS) {
+        pthread_mutex_unlock(&c->mtx);
+        free(d);
+        return -1;
+    }
+    c->dialers[c->num_dialers++] = d;
+    pthread_mutex_unlock(&c->mtx);
+    if (pthread_create(&d->tid, NULL, dialer_func, d) != 0) {
+        pthread_mutex_lock(&c->mtx);
+        c->num_dialers--;
+        pthread_mutex_unlock(&c->mtx);
+        free(d);
+        return -1;
+    }
+    return 0;
+}
+
+void cluster_shutdown(Cluster *c) {
+    if (!c) return;
+    chat_server_set_message_hook(c->chat, NULL, NULL);
+    pthread_mutex_lock(&c->mtx);
+    c->stopping = 1;
+    /* derruba todos os links: as threads de leitura saem e desregistram */
+    for (int i = 0; i < c->num_peers; i++) shutdown(c->peers[i]->fd, SHUT_RDWR);
+    for (int i = 0; i < c->num_dialers; i++) {
+        if (c->dialers[i]->fd >= 0) shutdown(c->dialers[i]->fd, SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->mtx);
+    /* dialers presos no poll do connect; o pipe nunca é lido, fica legível */
+    char b = 1;
+    ssize_t r = write(c->wake_pipe[1], &b, 1);
+    (void)r;
+
+    for (int i = 0; i < c->num_dialers; i++) {
+        pthread_join(c->dialers[i]->tid, NULL);
+        free(c->dialers[i]);
+    }
+    c->num_dialers = 0;
+    close(c->wake_pipe[0]);
+    close(c->wake_pipe[1]);
+
+    /* peers aceitos rodam nas threads de cliente (detached): espera saírem */
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += 2;
+    pthread_mutex_lock(&c->mtx);
+    while (c->num_peers > 0) {
+        if (pthread_cond_timedwait(&c->cond, &c->mtx, &deadline) == ETIMEDOUT) break;
+    }
+    pthread_mutex_unlock(&c->mtx);
+}
@@ -0,0 +1,64 @@
+#include "envelope.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+envelope_t *envelope_create(unsigned long seq, const char *name, const char *text) {
+    if (!name || !text) return NULL;
+    size_t text_len = strlen(text);
+    while (text_len > 0 && (text[text_len-1] == '\n' || text[text_len-1] == '\r')) {
+        text_len--;
+    }
+
+    time_t now = time(NULL);
+    struct tm t;
+    localtime_r(&now, &t);
+
+    /* mensagens sem sequência (ex.: privadas) não levam o campo "#seq" */
+    char seq_field[32] = "";
+    if (seq > 0) snprintf(seq_field, sizeof(seq_field), "#%lu ", seq);
+
+    /* calcula o tamanho exato antes de alocar: a formatação acontece uma vez só */
+    int head_len = snprintf(NULL, 0, "[%02d:%02d:%02d] %s%s: ",
+                            t.tm_hour, t.tm_min, t.tm_sec, seq_field, name);
+    if (head_len < 0) return NULL;
+    size_t len = (size_t)head_len + text_len + 1;
+
+    envelope_t *env = malloc(sizeof(envelope_t) + len + 1);
+    if (!env) return NULL;
+    snprintf(env->data, (size_t)head_len + 1, "[%02d:%02d:%02d] %s%s: ",
+             t.tm_hour, t.tm_min, t.tm_sec, seq_field, name);
+    memcpy(env->data + head_len, text, text_len);
+    env->data[len-1] = '\n';
+    env->data[len] = '\0';
+    env->seq = seq;
+    env->len = len;
+    env->refs = 1;
+    return env;
+}
+
+envelope_t *envelope_from_bytes(unsigned long seq, const char *data, size_t len) {
+    if (!data) return NULL;
+    envelope_t *env = malloc(sizeof(envelope_t) + len + 1);
+    if (!env) return NULL;
+    memcpy(env->data, data, len);
+    env->data[len] = '\0';
+    env->seq = seq;
+    env->len = len;
+    env->refs = 1;
+    return env;
+}
+
+envelope_t *envelope_ref(envelope_t *env) {
+    if (env) __atomic_add_fetch(&env->refs, 1, __ATOMIC_RELAXED);
+    return env;
+}
+
+void envelope_unref(envelope_t *env) {
+    if (!env) return;
+    /* acq_rel: quem libera por último precisa enxergar todas as escritas anteriores */
+    if (__atomic_sub_fetch(&env->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(env);
+    }
+}
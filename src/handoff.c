@@ -0,0 +1,327 @@
+#include "handoff.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define HANDOFF_MAX_PAYLOAD (64 * 1024)
+
+static int fill_addr(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) return -1;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (!path || fill_addr(&addr, path) != 0) return -1;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) return -1;
+    unlink(path); // arquivo de uma execução anterior (ou do processo que nos passou os sockets)
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* dados que não cabem no cabeçalho: linhas incompletas e histórico */
+static char *build_blob(const handoff_state_t *st, size_t *out_len) {
+    size_t len = 0;
+    for (int i = 0; i < st->num_clients; i++) len += st->pending_len ? st->pending_len[i] : 0;
+    for (int i = 0; i < st->history_count; i++) len += 48 + st->history[i]->len;
+    char *blob = malloc(len > 0 ? len : 1);
+    if (!blob) return NULL;
+    size_t pos = 0;
+    for (int i = 0; i < st->num_clients; i++) {
+        if (st->pending_len && st->pending_len[i] > 0) {
+            memcpy(blob + pos, st->pending[i], st->pending_len[i]);
+            pos += st->pending_len[i];
+        }
+    }
+    /* cada envelope: "<seq> <len>\n" seguido dos bytes já serializados */
+    for (int i = 0; i < st->history_count; i++) {
+        const envelope_t *env = st->history[i];
+        pos += (size_t)sprintf(blob + pos, "%lu %zu\n", env->seq, env->len);
+        memcpy(blob + pos, env->data, env->len);
+        pos += env->len;
+    }
+    *out_len = pos;
+    return blob;
+}
+
+static int send_packet(int conn_fd, struct msghdr *msg, size_t len) {
+    ssize_t n;
+    do {
+        n = sendmsg(conn_fd, msg, 0);
+    } while (n < 0 && errno == EINTR);
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+int handoff_send(int conn_fd, const handoff_state_t *st) {
+    if (!st || st->num_clients < 0 || st->num_clients + 1 > HANDOFF_MAX_FDS) return -1;
+
+    size_t blob_len = 0;
+    char *blob = build_blob(st, &blob_len);
+    /* cabeçalho: "HANDOFF2 <n> <next_seq> <hist> <bytes>\n" seguido de
+     * "<pendente> <nome>\n" por cliente (nome vazio = sem nome), na mesma
+     * ordem dos fds */
+    char *payload = malloc(HANDOFF_MAX_PAYLOAD);
+    if (!payload || !blob) {
+        free(payload);
+        free(blob);
+        return -1;
+    }
+    int len = snprintf(payload, HANDOFF_MAX_PAYLOAD, "HANDOFF2 %d %lu %d %zu\n",
+                       st->num_clients, st->next_seq, st->history_count, blob_len);
+    for (int i = 0; i < st->num_clients && len < HANDOFF_MAX_PAYLOAD; i++) {
+        len += snprintf(payload + len, HANDOFF_MAX_PAYLOAD - len, "%zu %s\n",
+                        st->pending_len ? st->pending_len[i] : 0,
+                        st->names[i] ? st->names[i] : "");
+    }
+    if (len >= HANDOFF_MAX_PAYLOAD) {
+        free(payload);
+        free(blob);
+        return -1;
+    }
+
+    int nfds = st->num_clients + 1;
+    size_t ctl_len = CMSG_SPACE(sizeof(int) * nfds);
+    char *ctl = calloc(1, ctl_len);
+    if (!ctl) {
+        free(payload);
+        free(blob);
+        return -1;
+    }
+    struct iovec iov = { payload, (size_t)len };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = ctl_len;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    int *fds = (int *)CMSG_DATA(cm);
+    fds[0] = st->listen_fd;
+    memcpy(fds + 1, st->client_fds, sizeof(int) * st->num_clients);
+    int rc = send_packet(conn_fd, &msg, (size_t)len);
+
+    /* o restante vai em pacotes de até HANDOFF_MAX_PAYLOAD (o receptor lê
+     * com um buffer do tamanho do que falta, então nada é truncado) */
+    for (size_t pos = 0; rc == 0 && pos < blob_len; ) {
+        size_t chunk = blob_len - pos < HANDOFF_MAX_PAYLOAD ? blob_len - pos : HANDOFF_MAX_PAYLOAD;
+        struct iovec biov = { blob + pos, chunk };
+        struct msghdr bmsg = {0};
+        bmsg.msg_iov = &biov;
+        bmsg.msg_iovlen = 1;
+        rc = send_packet(conn_fd, &bmsg, chunk);
+        pos += chunk;
+    }
+    free(ctl);
+    free(payload);
+    free(blob);
+    return rc;
+}
+
+/* lê blob_len bytes enviados em pacotes após o cabeçalho */
+static char *receive_blob(int fd, size_t blob_len) {
+    char *blob = malloc(blob_len > 0 ? blob_len : 1);
+    size_t got = 0;
+    while (blob && got < blob_len) {
+        ssize_t n = recv(fd, blob + got, blob_len - got, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            free(blob);
+            return NULL;
+        }
+        got += (size_t)n;
+    }
+    return blob;
+}
+
+/* reconstrói linhas pendentes e histórico a partir do blob; 0 ou -1 */
+static int parse_blob(handoff_state_t *st, const char *blob, size_t blob_len, int hist) {
+    size_t pos = 0;
+    for (int i = 0; i < st->num_clients; i++) {
+        size_t n = st->pending_len[i];
+        if (n == 0) continue;
+        if (n > blob_len - pos || !(st->pending[i] = malloc(n))) return -1;
+        memcpy(st->pending[i], blob + pos, n);
+        pos += n;
+    }
+    st->history = calloc(hist > 0 ? hist : 1, sizeof(envelope_t*));
+    if (!st->history) return -1;
+    for (int i = 0; i < hist; i++) {
+        const char *nl = memchr(blob + pos, '\n', blob_len - pos);
+        unsigned long seq;
+        size_t len;
+        if (!nl || sscanf(blob + pos, "%lu %zu", &seq, &len) != 2) return -1;
+        pos = (size_t)(nl - blob) + 1;
+        if (len > blob_len - pos) return -1;
+        st->history[i] = envelope_from_bytes(seq, blob + pos, len);
+        if (!st->history[i]) return -1;
+        st->history_count = i + 1;
+        pos += len;
+    }
+    return 0;
+}
+
+int handoff_receive(const char *path, handoff_state_t *st, int timeout_ms) {
+    struct sockaddr_un addr;
+    if (!path || !st || fill_addr(&addr, path) != 0) return -1;
+    memset(st, 0, sizeof(*st));
+    st->listen_fd = -1;
+    st->conn_fd = -1;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        /* nenhum processo antigo: inicialização normal */
+        return (err == ENOENT || err == ECONNREFUSED) ? 1 : -1;
+    }
+    struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    char *payload = malloc(HANDOFF_MAX_PAYLOAD + 1);
+    size_t ctl_len = CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS);
+    char *ctl = calloc(1, ctl_len);
+    if (!payload || !ctl) {
+        free(payload);
+        free(ctl);
+        close(fd);
+        return -1;
+    }
+    struct iovec iov = { payload, HANDOFF_MAX_PAYLOAD };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = ctl_len;
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+
+    int *fds = NULL;
+    int nfds = 0;
+    struct cmsghdr *cm = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+        fds = (int *)CMSG_DATA(cm);
+        nfds = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    }
+
+    int count = -1, hist = 0;
+    unsigned long next_seq = 0;
+    size_t blob_len = 0;
+    if (n > 0) {
+        payload[n] = '\0';
+        if (sscanf(payload, "HANDOFF2 %d %lu %d %zu", &count, &next_seq, &hist, &blob_len) != 4) count = -1;
+    }
+    if (count < 0 || hist < 0 || nfds != count + 1 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        for (int i = 0; i < nfds; i++) close(fds[i]);
+        free(payload);
+        free(ctl);
+        close(fd);
+        return -1;
+    }
+
+    st->listen_fd = fds[0];
+    st->num_clients = count;
+    st->next_seq = next_seq;
+    st->client_fds = calloc(count > 0 ? count : 1, sizeof(int));
+    st->names = calloc(count > 0 ? count : 1, sizeof(char*));
+    st->pending = calloc(count > 0 ? count : 1, sizeof(char*));
+    st->pending_len = calloc(count > 0 ? count : 1, sizeof(size_t));
+    int rc = (st->client_fds && st->names && st->pending && st->pending_len) ? 0 : -1;
+    if (rc == 0) {
+        memcpy(st->client_fds, fds + 1, sizeof(int) * count);
+        char *line = strchr(payload, '\n');
+        for (int i = 0; i < count && line; i++) {
+            char *start = line + 1;
+            line = strchr(start, '\n');
+            if (line) *line = '\0';
+            char *name;
+            st->pending_len[i] = strtoul(start, &name, 10);
+            start = (*name == ' ') ? name + 1 : name;
+            st->names[i] = *start ? strdup(start) : NULL;
+        }
+    }
+    if (rc == 0) {
+        char *blob = receive_blob(fd, blob_len);
+        rc = (blob && parse_blob(st, blob, blob_len, hist) == 0) ? 0 : -1;
+        free(blob);
+    }
+    if (rc != 0) {
+        close(fd);
+        for (int i = 0; i < nfds; i++) close(fds[i]);
+        handoff_state_free(st);
+    } else {
+        st->conn_fd = fd; /* fica aberta até handoff_ack */
+    }
+    free(payload);
+    free(ctl);
+    return rc;
+}
+
+int handoff_ack(handoff_state_t *st) {
+    if (!st || st->conn_fd < 0) return -1;
+    int rc = -1;
+    if (send(st->conn_fd, "ACK", 3, MSG_NOSIGNAL) == 3) {
+        /* o processo antigo responde logo; se ele já desistiu (timeout) a
+         * conexão está fechada e o recv retorna 0 */
+        char reply[8];
+        ssize_t n;
+        do {
+            n = recv(st->conn_fd, reply, sizeof(reply), 0);
+        } while (n < 0 && errno == EINTR);
+        if (n == 2 && memcmp(reply, "GO", 2) == 0) rc = 0;
+    }
+    close(st->conn_fd);
+    st->conn_fd = -1;
+    return rc;
+}
+
+int handoff_wait_ack(int conn_fd, int timeout_ms) {
+    struct pollfd pfd = { conn_fd, POLLIN, 0 };
+    int n;
+    do {
+        n = poll(&pfd, 1, timeout_ms);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return -1;
+    char reply[8];
+    ssize_t r = recv(conn_fd, reply, sizeof(reply), MSG_DONTWAIT);
+    if (r != 3 || memcmp(reply, "ACK", 3) != 0) return -1; /* 0: o novo processo saiu */
+    return send(conn_fd, "GO", 2, MSG_NOSIGNAL) == 2 ? 0 : -1;
+}
+
+void handoff_state_free(handoff_state_t *st) {
+    if (!st) return;
+    for (int i = 0; i < st->num_clients; i++) {
+        if (st->names) free(st->names[i]);
+        if (st->pending) free(st->pending[i]);
+    }
+    for (int i = 0; i < st->history_count; i++) envelope_unref(st->history[i]);
+    free(st->names);
+    free(st->pending);
+    free(st->pending_len);
+    free(st->client_fds);
+    free(st->history);
+    st->names = NULL;
+    st->pending = NULL;
+    st->pending_len = NULL;
+    st->client_fds = NULL;
+    st->history = NULL;
+    st->num_clients = 0;
+    st->history_count = 0;
+}
@@ -1,6 +1,8 @@
 #include "net.h"
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
 
 ssize_t send_all(int fd, const void *buf, size_t len) {
     const char *p = buf;
@@ -17,3 +19,36 @@ ssize_t send_all(int fd, const void *buf, size_t len) {
     }
     return (ssize_t)len;
 }
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+ssize_t send_all_timeout(int fd, const void *buf, size_t len, int timeout_ms) {
+    const char *p = buf;
+    size_t left = len;
+    long long deadline = now_ms() + timeout_ms;
+    /* sem bloquear no send: com SO_SNDTIMEO cada send parcial recomeçaria
+     * a contagem e um cliente lento seguraria o envio por muito mais */
+    while (left > 0) {
+        ssize_t n = send(fd, p, left, MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            long long remaining = deadline - now_ms();
+            if (remaining <= 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            if (poll(&pfd, 1, (int)remaining) < 0 && errno != EINTR) return -1;
+            continue;
+        }
+        if (n == 0) return -1;
+        p += n;
+        left -= n;
+    }
+    return (ssize_t)len;
+}
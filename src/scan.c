@@ -0,0 +1,250 @@
+#include "scan.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+/* ---- versões escalares ---- */
+
+/* valida um caractere a partir de s[i]; retorna o índice do próximo ou 0 se inválido */
+static size_t utf8_step(const unsigned char *s, size_t len, size_t i) {
+    unsigned char c = s[i];
+    if (c < 0x80) {
+        return ((c >= 0x20 && c != 0x7F) || c == '\t') ? i + 1 : 0;
+    }
+    size_t n;
+    unsigned char lo = 0x80, hi = 0xBF; // faixa válida do segundo byte
+    if (c >= 0xC2 && c <= 0xDF) {
+        n = 1;
+    } else if (c == 0xE0) {
+        n = 2; lo = 0xA0;       // sem overlong
+    } else if (c == 0xED) {
+        n = 2; hi = 0x9F;       // sem surrogates
+    } else if (c >= 0xE1 && c <= 0xEF) {
+        n = 2;
+    } else if (c == 0xF0) {
+        n = 3; lo = 0x90;       // sem overlong
+    } else if (c >= 0xF1 && c <= 0xF3) {
+        n = 3;
+    } else if (c == 0xF4) {
+        n = 3; hi = 0x8F;       // até U+10FFFF
+    } else {
+        return 0;
+    }
+    if (len - i - 1 < n) return 0;
+    if (s[i + 1] < lo || s[i + 1] > hi) return 0;
+    for (size_t k = 2; k <= n; k++) {
+        if ((s[i + k] & 0xC0) != 0x80) return 0;
+    }
+    return i + n + 1;
+}
+
+size_t scan_delim_scalar(const char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == '\n') return i;
+    }
+    return len;
+}
+
+int scan_validate_scalar(const char *buf, size_t len) {
+    const unsigned char *s = (const unsigned char *)buf;
+    size_t i = 0;
+    while (i < len) {
+        i = utf8_step(s, len, i);
+        if (i == 0) return -1;
+    }
+    return 0;
+}
+
+/*
+ * Caminho vetorial da validação: um bloco todo de ASCII imprimível (o caso
+ * comum no chat) é aceito com uma comparação; senão o bloco é validado
+ * caractere a caractere e o vetor volta a ser usado na próxima fronteira.
+ */
+static int validate_from(const unsigned char *s, size_t len, size_t i, size_t stop) {
+    while (i < stop) {
+        i = utf8_step(s, len, i);
+        if (i == 0) return -1;
+    }
+    return (int)(i - stop); // quanto o último caractere passou do bloco
+}
+
+/* como utf8_step, aceitando também '\n' e o '\r' de um "\r\n" */
+static size_t line_step(const unsigned char *s, size_t len, size_t i) {
+    if (s[i] == '\n') return i + 1;
+    if (s[i] == '\r') return (i + 1 < len && s[i + 1] == '\n') ? i + 1 : 0;
+    return utf8_step(s, len, i);
+}
+
+/* valida de i até passar de stop; retorna onde terminou o último caractere
+ * (>= stop) ou a posição do primeiro que não pôde ser aceito (< stop) */
+static size_t lines_from(const unsigned char *s, size_t len, size_t i, size_t stop) {
+    while (i < stop) {
+        size_t next = line_step(s, len, i);
+        if (next == 0) return i;
+        i = next;
+    }
+    return i;
+}
+
+size_t scan_validate_lines_scalar(const char *buf, size_t len) {
+    return lines_from((const unsigned char *)buf, len, 0, len);
+}
+
+size_t scan_utf8_boundary(const char *buf, size_t len) {
+    const unsigned char *s = (const unsigned char *)buf;
+    size_t i = len;
+    /* volta sobre até 3 bytes de continuação até o byte inicial */
+    while (i > 0 && len - i < 3 && (s[i - 1] & 0xC0) == 0x80) i--;
+    if (i == 0) return len;
+    unsigned char c = s[i - 1];
+    size_t need = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+    return (c >= 0xC0 && len - (i - 1) < need) ? i - 1 : len;
+}
+
+#ifdef SCAN_X86
+
+static size_t scan_delim_sse2(const char *buf, size_t len) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        int m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (m) return i + (size_t)__builtin_ctz((unsigned)m);
+    }
+    return i + scan_delim_scalar(buf + i, len - i);
+}
+
+static int scan_validate_sse2(const char *buf, size_t len) {
+    const unsigned char *s = (const unsigned char *)buf;
+    const __m128i low = _mm_set1_epi8(0x1F), del = _mm_set1_epi8(0x7F);
+    size_t i = 0;
+    while (i + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        /* comparação com sinal: bytes >= 0x80 são negativos e caem fora */
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, low), _mm_cmplt_epi8(v, del));
+        if (_mm_movemask_epi8(ok) == 0xFFFF) {
+            i += 16;
+            continue;
+        }
+        int over = validate_from(s, len, i, i + 16);
+        if (over < 0) return -1;
+        i += 16 + (size_t)over;
+    }
+    return validate_from(s, len, i, len) < 0 ? -1 : 0;
+}
+
+static size_t scan_validate_lines_sse2(const char *buf, size_t len) {
+    const unsigned char *s = (const unsigned char *)buf;
+    const __m128i low = _mm_set1_epi8(0x1F), del = _mm_set1_epi8(0x7F), nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    while (i + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i ok = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi8(v, low), _mm_cmplt_epi8(v, del)),
+                                  _mm_cmpeq_epi8(v, nl));
+        if (_mm_movemask_epi8(ok) == 0xFFFF) {
+            i += 16;
+            continue;
+        }
+        size_t next = lines_from(s, len, i, i + 16);
+        if (next < i + 16) return next;
+        i = next;
+    }
+    return lines_from(s, len, i, len);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_delim_avx2(const char *buf, size_t len) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        if (m) return i + (size_t)__builtin_ctz(m);
+    }
+    return i + scan_delim_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int scan_validate_avx2(const char *buf, size_t len) {
+    const unsigned char *s = (const unsigned char *)buf;
+    const __m256i low = _mm256_set1_epi8(0x1F), del = _mm256_set1_epi8(0x7F);
+    size_t i = 0;
+    while (i + 32 <= len) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, low), _mm256_cmpgt_epi8(del, v));
+        if ((unsigned)_mm256_movemask_epi8(ok) == 0xFFFFFFFFu) {
+            i += 32;
+            continue;
+        }
+        int over = validate_from(s, len, i, i + 32);
+        if (over < 0) return -1;
+        i += 32 + (size_t)over;
+    }
+    return validate_from(s, len, i, len) < 0 ? -1 : 0;
+}
+
+__attribute__((target("avx2")))
+static size_t scan_validate_lines_avx2(const char *buf, size_t len) {
+    const unsigned char *s = (const unsigned char *)buf;
+    const __m256i low = _mm256_set1_epi8(0x1F), del = _mm256_set1_epi8(0x7F), nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    while (i + 32 <= len) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i ok = _mm256_or_si256(_mm256_and_si256(_mm256_cmpgt_epi8(v, low), _mm256_cmpgt_epi8(del, v)),
+                                     _mm256_cmpeq_epi8(v, nl));
+        if ((unsigned)_mm256_movemask_epi8(ok) == 0xFFFFFFFFu) {
+            i += 32;
+            continue;
+        }
+        size_t next = lines_from(s, len, i, i + 32);
+        if (next < i + 32) return next;
+        i = next;
+    }
+    return lines_from(s, len, i, len);
+}
+
+#endif // SCAN_X86
+
+/* ---- escolha da implementação (uma vez, antes do main) ---- */
+
+static size_t (*delim_impl)(const char *, size_t) = scan_delim_scalar;
+static int (*validate_impl)(const char *, size_t) = scan_validate_scalar;
+static size_t (*lines_impl)(const char *, size_t) = scan_validate_lines_scalar;
+static const char *impl_name = "escalar";
+
+__attribute__((constructor))
+static void scan_select(void) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        delim_impl = scan_delim_avx2;
+        validate_impl = scan_validate_avx2;
+        lines_impl = scan_validate_lines_avx2;
+        impl_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        delim_impl = scan_delim_sse2;
+        validate_impl = scan_validate_sse2;
+        lines_impl = scan_validate_lines_sse2;
+        impl_name = "sse2";
+    }
+#endif
+}
+
+size_t scan_delim(const char *buf, size_t len) {
+    return delim_impl(buf, len);
+}
+
+int scan_validate(const char *buf, size_t len) {
+    return validate_impl(buf, len);
+}
+
+size_t scan_validate_lines(const char *buf, size_t len) {
+    return lines_impl(buf, len);
+}
+
+const char *scan_impl_name(void) {
+    return impl_name;
+}
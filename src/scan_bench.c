@@ -0,0 +1,162 @@
+#include "scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * scan_bench: compara a varredura vetorial (scan_delim/scan_validate) com
+ * o caminho byte a byte e com o memchr da libc, sobre um buffer grande de
+ * linhas parecidas com as do chat, e a validação linha a linha com a
+ * passada única pelo buffer (scan_validate_lines), como no client_thread. Antes de medir, confere em entradas
+ * aleatórias que as versões concordam.
+ *
+ * Uso: scan_bench [MB] [REPETICOES]
+ */
+
+#define LINE_MIN 16
+#define LINE_MAX 400
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* gera linhas de texto; uma em cada oito tem acentos (UTF-8 de 2 e 3 bytes) */
+static size_t fill_lines(char *buf, size_t size) {
+    static const char *accents[] = { "\xc3\xa7\xc3\xa3o", "\xc3\xa9", "\xe2\x82\xac" }; // "ção", "é", "€"
+    size_t used = 0;
+    while (used + LINE_MAX + 16 < size) {
+        int n = LINE_MIN + rand() % (LINE_MAX - LINE_MIN);
+        int utf8 = (rand() % 8) == 0;
+        for (int i = 0; i < n; i++) {
+            if (utf8 && i % 23 == 0) {
+                const char *a = accents[rand() % 3];
+                size_t al = strlen(a);
+                memcpy(buf + used, a, al);
+                used += al;
+            } else {
+                buf[used++] = (char)(' ' + rand() % 95);
+            }
+        }
+        buf[used++] = '\n';
+    }
+    return used;
+}
+
+typedef size_t (*delim_fn)(const char *, size_t);
+typedef int (*validate_fn)(const char *, size_t);
+
+static size_t delim_memchr(const char *buf, size_t len) {
+    const char *p = memchr(buf, '\n', len);
+    return p ? (size_t)(p - buf) : len;
+}
+
+/* percorre o buffer linha a linha, como o client_thread; validate pode ser NULL */
+static double run(const char *buf, size_t len, delim_fn delim, validate_fn validate, int reps, long *lines) {
+    double best = 1e9;
+    for (int r = 0; r < reps; r++) {
+        long count = 0;
+        double t0 = now_s();
+        size_t start = 0;
+        while (start < len) {
+            size_t n = delim(buf + start, len - start);
+            if (validate && validate(buf + start, n) != 0) count--;
+            count++;
+            start += n + 1;
+        }
+        double dt = now_s() - t0;
+        if (dt < best) best = dt;
+        *lines = count;
+    }
+    return best;
+}
+
+/* delimita as linhas e valida o buffer inteiro numa passada; uma linha
+ * inválida faz a validação recomeçar na seguinte */
+static double run_lines(const char *buf, size_t len, int reps, long *lines) {
+    double best = 1e9;
+    for (int r = 0; r < reps; r++) {
+        long count = 0;
+        double t0 = now_s();
+        size_t checked = scan_validate_lines(buf, len);
+        size_t start = 0;
+        while (start < len) {
+            size_t nl = start + scan_delim(buf + start, len - start);
+            if (checked > nl) {
+                count++;
+            } else if (nl < len) {
+                checked = nl + 1 + scan_validate_lines(buf + nl + 1, len - nl - 1);
+            }
+            start = nl + 1;
+        }
+        double dt = now_s() - t0;
+        if (dt < best) best = dt;
+        *lines = count;
+    }
+    return best;
+}
+
+/* confere que vetor e escalar concordam em entradas aleatórias */
+static int check(void) {
+    static const unsigned char pool[] = {
+        'a', 'Z', ' ', '~', '\t', '\n', '\r', 0x00, 0x1F, 0x7F, 0x80, 0xBF, 0xC0, 0xC2, 0xC3, 0xDF,
+        0xE0, 0xA0, 0xED, 0x9F, 0xEF, 0xF0, 0x90, 0xF4, 0x8F, 0xF5, 0xFF, 0xA9, 0x82, 0xAC
+    };
+    char buf[256];
+    for (int iter = 0; iter < 200000; iter++) {
+        size_t len = (size_t)(rand() % (int)sizeof(buf));
+        int mostly_ascii = rand() % 2;
+        for (size_t i = 0; i < len; i++) {
+            if (mostly_ascii && rand() % 16) buf[i] = (char)(' ' + rand() % 95);
+            else buf[i] = (char)pool[rand() % sizeof(pool)];
+        }
+        if (scan_delim(buf, len) != scan_delim_scalar(buf, len) ||
+            scan_validate(buf, len) != scan_validate_scalar(buf, len) ||
+            scan_validate_lines(buf, len) != scan_validate_lines_scalar(buf, len)) {
+            fprintf(stderr, "Divergencia na entrada %d (len=%zu)\n", iter, len);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    size_t mb = argc > 1 ? (size_t)atoi(argv[1]) : 64;
+    int reps = argc > 2 ? atoi(argv[2]) : 5;
+    if (mb == 0 || reps <= 0) {
+        fprintf(stderr, "Uso: %s [MB] [REPETICOES]\n", argv[0]);
+        return 1;
+    }
+    srand(42);
+    if (check() != 0) return 1;
+
+    size_t size = mb * 1024 * 1024;
+    char *buf = malloc(size);
+    if (!buf) {
+        perror("malloc");
+        return 1;
+    }
+    size_t len = fill_lines(buf, size);
+    double total_mb = len / (1024.0 * 1024.0);
+    long lines;
+    printf("Implementacao: %s, %.0f MB, %d repeticoes (melhor tempo)\n", scan_impl_name(), total_mb, reps);
+
+    double t = run(buf, len, scan_delim_scalar, NULL, reps, &lines);
+    printf("delimitador  byte a byte  %8.0f MB/s (%ld linhas)\n", total_mb / t, lines);
+    t = run(buf, len, delim_memchr, NULL, reps, &lines);
+    printf("delimitador  memchr       %8.0f MB/s\n", total_mb / t);
+    t = run(buf, len, scan_delim, NULL, reps, &lines);
+    printf("delimitador  scan_delim   %8.0f MB/s\n", total_mb / t);
+
+    t = run(buf, len, scan_delim_scalar, scan_validate_scalar, reps, &lines);
+    printf("delim+valida byte a byte  %8.0f MB/s (%ld validas)\n", total_mb / t, lines);
+    t = run(buf, len, scan_delim, scan_validate, reps, &lines);
+    printf("delim+valida vetorial     %8.0f MB/s (%ld validas)\n", total_mb / t, lines);
+    t = run_lines(buf, len, reps, &lines);
+    printf("delim+valida buffer       %8.0f MB/s (%ld validas)\n", total_mb / t, lines);
+
+    free(buf);
+    return 0;
+}
@@ -8,194 +8,831 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include "chat_server.h"
+#include "handoff.h"
 #include "net.h"
+#include "trace.h"
+#include "cluster.h"
+#include "scan.h"
+#include "affinity.h"
 
-#define PORT 9000
+#define DEFAULT_PORT 9000
 #define MAX_CLIENTS 10
+#define MAX_LINE 4096 /* maior mensagem aceita em uma linha */
 
-static volatile sig_atomic_t server_running = 1;
-static int server_fd_global = -1;
+/* prazo do drain; o tempo total pode passar disso em até CHAT_SEND_TIMEOUT_MS
+ * (um envio a um cliente lento já em curso, ver chat_server_drain) */
+#define DRAIN_TIMEOUT_MS 5000
+/* espera do novo processo no handoff: parada das threads de cliente e drain
+ * do processo antigo, cada um com DRAIN_TIMEOUT_MS, mais o envio em curso */
+#define HANDOFF_WAIT_MS (2 * DRAIN_TIMEOUT_MS + CHAT_SEND_TIMEOUT_MS + 1000)
+/* espera do processo antigo pela confirmação do novo (que só inicializa o
+ * ChatServer e o cluster entre receber e confirmar) */
+#define HANDOFF_ACK_MS DRAIN_TIMEOUT_MS
+#define MAX_IO_CPUS 1024
+
+/* modo de parada pedido por sinal */
+enum { STOP_NONE, STOP_NOW, STOP_DRAIN };
+
+static volatile sig_atomic_t stop_mode = STOP_NONE;
+static volatile sig_atomic_t dump_requested = 0;
+static int wake_pipe[2] = { -1, -1 };
 static ChatServer chat;
+static Cluster cluster;
+static int cluster_enabled = 0;
 
-static void sigint_handler(int signo) {
-    (void)signo;
-    server_running = 0;
-    if (server_fd_global != -1) {
-        close(server_fd_global);
-        server_fd_global = -1;
-    }
+/* CPUs das threads de cliente (--cpu-io), distribuídas em rodízio */
+static int io_cpus[MAX_IO_CPUS];
+static int num_io_cpus = 0;
+static unsigned next_io_cpu = 0;
+
+/* parada das threads de cliente antes do handoff: o pipe é escrito uma vez e
+ * nunca lido, então fica legível para todas; readers_active conta as threads
+ * que ainda leem do socket (funciona como um join das threads destacadas) */
+static int readers_stop_pipe[2] = { -1, -1 };
+static pthread_mutex_t readers_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readers_cond = PTHREAD_COND_INITIALIZER;
+static int readers_active = 0;
+static int readers_stopped = 0; /* o byte de parada está no pipe */
+
+/* argumento da thread de cliente: bytes herdados de um handoff iniciam o buffer */
+typedef struct {
+    int fd;
+    char *pending;
+    size_t pending_len;
+} client_arg_t;
+
+static void signal_handler(int signo) {
     /*
-     * Handler de SIGINT: marcar o servidor para parar e fechar o socket
-     * de escuta. Atenção: chamar funções complexas (por exemplo
-     * chat_server_shutdown) diretamente dentro de um signal handler pode
-     * ser inseguro, pois muitas funções não são async-signal-safe. Aqui
-     * apenas setamos a flag e fechamos o descritor de escuta para que
-     * accept() seja desbloqueado; o encerramento completo é feito na
-     * thread principal.
+     * Handler de SIGINT/SIGTERM: apenas registra o modo de parada e
+     * acorda o poll() da thread principal escrevendo no self-pipe
+     * (write é async-signal-safe). Chamar funções complexas (por exemplo
+     * chat_server_shutdown) aqui seria inseguro; o encerramento completo
+     * é feito na thread principal.
+     *  - SIGINT: encerramento imediato (comportamento anterior)
+     *  - SIGTERM: encerramento gracioso, drenando fila e buffers
+     *  - SIGUSR1: grava o trace do caminho das mensagens (make TRACE=1)
      */
-    /* sinal recebido; main() irá lidar com o encerramento e registrar o log */
+    int saved = errno;
+    if (signo == SIGUSR1) {
+        dump_requested = 1; // pedido de dump do trace (não encerra)
+    } else {
+        stop_mode = (signo == SIGTERM) ? STOP_DRAIN : STOP_NOW;
+    }
+    if (wake_pipe[1] != -1) {
+        char c = 1;
+        ssize_t r = write(wake_pipe[1], &c, 1);
+        (void)r;
+    }
+    errno = saved;
+}
+
+/* registra o nome do cliente; nomes são únicos por causa do /msg */
+static void register_name(int sock, const char *name) {
+    if (chat_server_set_name(&chat, sock, name) != 0) {
+        char reply[160];
+        int invalid = !name[0] || name[0] == '#';
+        snprintf(reply, sizeof(reply), invalid ? "*** nome '%s' invalido (vazio ou comecando com '#')\n"
+                                               : "*** nome '%s' ja esta em uso\n", name);
+        chat_server_send_to(&chat, sock, reply, strlen(reply));
+        tslog_write(LOG_WARN, "Nome '%s' recusado para o cliente %d (%s)", name, sock, invalid ? "invalido" : "em uso");
+        return;
+    }
+    tslog_write(LOG_INFO, "Cliente identificado: %s (fd=%d)", name, sock);
+}
+
+/* trata "/msg <nome> <texto>": resolve o destinatário pelo nome e envia sem
+ * passar pelo broadcaster; responde ao remetente em caso de erro */
+static void handle_private_message(int sock, char *args) {
+    size_t end = strcspn(args, "\r\n");
+    args[end] = '\0';
+    char *space = strchr(args, ' ');
+    if (!space || space == args || !space[1]) {
+        const char *usage = "*** uso: /msg <nome> <mensagem>\n";
+        chat_server_send_to(&chat, sock, usage, strlen(usage));
+        return;
+    }
+    *space = '\0';
+    const char *target = args;
+    const char *text = space + 1;
+    if (chat_server_send_private(&chat, sock, target, text) != 0) {
+        char reply[160];
+        snprintf(reply, sizeof(reply), "*** usuario '%s' nao encontrado\n", target);
+        chat_server_send_to(&chat, sock, reply, strlen(reply));
+        tslog_write(LOG_WARN, "Mensagem privada do cliente %d para '%s' nao entregue", sock, target);
+        return;
+    }
+    tslog_write(LOG_INFO, "Mensagem privada do cliente %d entregue a %s", sock, target);
+}
+
+/* trata uma linha completa recebida do cliente (sem o '\n'), de n bytes */
+static void handle_line(int sock, char *line, size_t n) {
+    if (n > 0 && line[n-1] == '\r') line[--n] = '\0';
+    if (n == 0) return;
+
+    /* heartbeat: qualquer dado já conta como atividade (chat_server_touch) */
+    if (strcmp(line, "PONG") == 0) return;
+    if (strcmp(line, "PING") == 0) {
+        chat_server_send_to(&chat, sock, "PONG\n", 5);
+        return;
+    }
+    /* Se for uma mensagem de nome (prefixo NAME:), registre o nome e não broadcast */
+    if (strncmp(line, "NAME:", 5) == 0) {
+        register_name(sock, line + 5);
+        return;
+    }
+    /* RESUME:<seq> reenvia só o que o cliente perdeu desde <seq>; a
+     * sequência é a deste nó (no cluster cada nó numera por conta própria) */
+    if (strncmp(line, "RESUME:", 7) == 0) {
+        unsigned long after = strtoul(line + 7, NULL, 10);
+        int sent = chat_server_send_since(&chat, sock, after);
+        tslog_write(LOG_INFO, "Cliente %d retomou a partir de #%lu (%d mensagens reenviadas)", sock, after, sent);
+        return;
+    }
+    /* ECHO:1 faz o cliente receber também as próprias mensagens (medição de RTT) */
+    if (strncmp(line, "ECHO:", 5) == 0) {
+        chat_server_set_echo(&chat, sock, atoi(line + 5) != 0);
+        return;
+    }
+    /* mensagem privada: /msg <nome> <texto> vai direto ao destinatário */
+    if (strncmp(line, "/msg ", 5) == 0) {
+        handle_private_message(sock, line + 5);
+        return;
+    }
+    /* log com nome quando disponível */
+    char cname[256];
+    if (chat_server_get_name(&chat, sock, cname, sizeof(cname)) == 0) {
+        tslog_write(LOG_INFO, "Mensagem recebida de %s (cliente %d): %s", cname, sock, line);
+    } else {
+        tslog_write(LOG_INFO, "Mensagem recebida do cliente %d: %s", sock, line);
+    }
+    /* mensagem a ser colocada na fila pra broadcast */
+    chat_server_enqueue_message(&chat, line, sock);
+}
+
+/* avisa o cliente e descarta uma linha que não passou na validação */
+static void reject_line(int sock, size_t n) {
+    const char *reply = "*** mensagem descartada: UTF-8 invalido ou caractere de controle\n";
+    chat_server_send_to(&chat, sock, reply, strlen(reply));
+    tslog_write(LOG_WARN, "Linha invalida do cliente %d descartada (%zu bytes)", sock, n);
+}
+
+/* valida o texto antes de tratar a linha; linhas inválidas são descartadas */
+static void accept_line(int sock, char *line, size_t n) {
+    size_t check = (n > 0 && line[n-1] == '\r') ? n - 1 : n;
+    if (scan_validate(line, check) != 0) {
+        reject_line(sock, n);
+        return;
+    }
+    handle_line(sock, line, n);
+}
+
+/* a conexão se identificou como outro servidor: deixa de ser cliente e passa
+ * a trocar frames do cluster (bloqueia até o peer desconectar) */
+static void become_peer(int sock, const char *hello, const char *pending, size_t pending_len) {
+    chat_server_remove_client(&chat, sock); /* libera a vaga; o fd segue vivo pela referência da thread */
+    if (!cluster_enabled) {
+        tslog_write(LOG_WARN, "Conexao %d se apresentou como peer, mas o modo cluster esta desligado", sock);
+        return;
+    }
+    cluster_serve_peer(&cluster, sock, hello, pending, pending_len);
+}
+
+/* a thread deixou de ler do socket (saída, peer ou parada para handoff) */
+static void reader_done(void) {
+    pthread_mutex_lock(&readers_mtx);
+    readers_active--;
+    pthread_cond_broadcast(&readers_cond);
+    pthread_mutex_unlock(&readers_mtx);
 }
 
 // Função para lidar com comunicação de um cliente (em cada thread)
 void *client_thread(void *arg) {
-    int sock = *(int *)arg;
-    free(arg);
-    char buffer[256];
+    client_arg_t *ca = arg;
+    int sock = ca->fd;
+    char buffer[MAX_LINE + 1];
+    size_t used = ca->pending_len < MAX_LINE ? ca->pending_len : MAX_LINE;
+    if (used > 0) memcpy(buffer, ca->pending, used);
+    free(ca->pending);
+    free(ca);
     ssize_t len;
+    int is_peer = 0;
+    int stopped = 0;
+    /* buffer[0..checked) já foi validado; checked para no primeiro byte que
+     * não pôde ser aceito (inválido, ou caractere ainda incompleto) */
+    size_t checked = 0;
+    /* referência própria: a conexão (e o fd) vive até esta thread terminar */
+    ChatConn *conn = chat_server_conn_acquire(&chat, sock);
 
     /*
      * Thread por cliente: lê do socket do cliente e enfileira as
      * mensagens recebidas na fila do ChatServer. Esta thread não envia
      * broadcasts diretamente para evitar races em send(); a thread
      * broadcaster faz o reencaminhamento para os demais clientes.
+     *
+     * Cada mensagem termina em '\n'. Um recv pode trazer várias
+     * mensagens (cliente enviando em pipeline) ou só parte de uma; o
+     * resto fica no buffer até o próximo recv.
+     *
+     * A validação do texto (scan.h) é uma passada só sobre os bytes novos
+     * de cada recv, cobrindo todas as linhas de uma vez; só depois de uma
+     * linha inválida a varredura recomeça, na linha seguinte.
+     *
+     * O poll também observa readers_stop_pipe: no handoff a thread para
+     * entre dois recv, com as linhas completas já enfileiradas, e guarda a
+     * linha incompleta para o próximo processo.
      */
-    while ((len = recv(sock, buffer, sizeof(buffer)-1, 0)) > 0) {
-        buffer[len] = '\0';
-        /* Se for uma mensagem de nome (prefixo NAME:), registre o nome e não broadcast */
-        if (strncmp(buffer, "NAME:", 5) == 0) {
-            /* procurar por newline que delimita o nome */
-            char *newline = strchr(buffer + 5, '\n');
-            if (newline) {
-                *newline = '\0';
-                const char *name = buffer + 5;
-                chat_server_set_name(&chat, sock, name);
-                tslog_write(LOG_INFO, "Cliente identificado: %s (fd=%d)", name, sock);
-                /* se existir conteúdo após o newline, tratar como mensagem normal */
-                char *leftover = newline + 1;
-                if (*leftover) {
-                    const char *cname2 = chat_server_get_name(&chat, sock);
-                    if (cname2) {
-                        tslog_write(LOG_INFO, "Mensagem recebida de %s (cliente %d): %s", cname2, sock, leftover);
-                    } else {
-                        tslog_write(LOG_INFO, "Mensagem recebida do cliente %d: %s", sock, leftover);
-                    }
-                    chat_server_enqueue_message(&chat, leftover, sock);
-                }
+    for (;;) {
+        struct pollfd pfds[2] = {
+            { sock, POLLIN, 0 },
+            { readers_stop_pipe[0], POLLIN, 0 }, /* -1 sem --handoff */
+        };
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pfds[1].revents & POLLIN) {
+            stopped = 1;
+            break;
+        }
+        len = recv(sock, buffer + used, MAX_LINE - used, 0);
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) break;
+        TRACE_MARK_RECV();
+        chat_server_touch(conn);
+        used += (size_t)len;
+        checked += scan_validate_lines(buffer + checked, used - checked);
+        size_t start = 0, nl;
+        /* procura os '\n' do buffer inteiro com a varredura vetorial (scan.h) */
+        while ((nl = start + scan_delim(buffer + start, used - start)) < used) {
+            int valid = checked > nl;
+            buffer[nl] = '\0';
+            char *line = buffer + start;
+            size_t line_len = nl - start;
+            start = nl + 1;
+            if (strncmp(line, "PEER:", 5) == 0) {
+                /* o restante do buffer já são frames do peer; conexões de
+                 * peer não passam pelo handoff */
+                reader_done();
+                become_peer(sock, line, buffer + start, used - start);
+                is_peer = 1;
+                break;
+            }
+            if (valid) {
+                handle_line(sock, line, line_len);
+            } else {
+                reject_line(sock, line_len);
+                checked = start + scan_validate_lines(buffer + start, used - start);
+            }
+        }
+        if (is_peer) break;
+        if (start == 0 && used == MAX_LINE) {
+            /* linha maior que o buffer: entrega o que coube como uma
+             * mensagem, sem cortar um caractere UTF-8 (os bytes dele ficam
+             * para o começo da próxima) */
+            size_t cut = scan_utf8_boundary(buffer, used);
+            if (cut > 0 && buffer[cut - 1] == '\r') cut--; /* o '\n' pode vir no próximo recv */
+            if (cut == 0) cut = used;
+            char rest[4];
+            size_t rest_len = used - cut;
+            memcpy(rest, buffer + cut, rest_len);
+            int valid = checked >= cut;
+            buffer[cut] = '\0';
+            if (valid) {
+                handle_line(sock, buffer, cut);
             } else {
-                /* sem newline — trate todo o buffer como nome (compatibilidade) */
-                const char *name = buffer + 5;
-                chat_server_set_name(&chat, sock, name);
-                tslog_write(LOG_INFO, "Cliente identificado: %s (fd=%d)", name, sock);
+                reject_line(sock, cut);
             }
+            memcpy(buffer, rest, rest_len);
+            used = rest_len;
+            checked = scan_validate_lines(buffer, used);
             continue;
         }
-        /* log com nome quando disponível */
-        const char *cname = chat_server_get_name(&chat, sock);
-        if (cname) {
-            tslog_write(LOG_INFO, "Mensagem recebida de %s (cliente %d): %s", cname, sock, buffer);
-        } else {
-            tslog_write(LOG_INFO, "Mensagem recebida do cliente %d: %s", sock, buffer);
+        memmove(buffer, buffer + start, used - start);
+        used -= start;
+        checked -= start;
+    }
+    if (stopped) {
+        /* o cliente continua registrado: fd, nome e linha incompleta vão
+         * para o novo processo em do_handoff */
+        if (chat_server_save_pending(&chat, sock, buffer, used) != 0) {
+            tslog_write(LOG_WARN, "Handoff: linha incompleta do cliente %d perdida", sock);
         }
-        /* mensagem a ser colocada na fila pra broadcast */
-        chat_server_enqueue_message(&chat, buffer, sock);
+        chat_server_conn_release(conn);
+        reader_done();
+        return NULL;
+    }
+    if (is_peer) {
+        chat_server_conn_release(conn);
+        tslog_write(LOG_INFO, "Conexao de peer %d encerrada.", sock);
+        return NULL;
+    }
+    /* conexão fechada com uma última linha sem '\n' */
+    if (used > 0) {
+        buffer[used] = '\0';
+        accept_line(sock, buffer, used);
     }
 
-    /* remove client e faz a limpeza */
+    /* remove client e faz a limpeza (o ChatServer fecha o socket) */
     chat_server_remove_client(&chat, sock);
-    close(sock);
+    chat_server_conn_release(conn);
+    reader_done();
     tslog_write(LOG_INFO, "Cliente %d desconectado.", sock);
     return NULL;
 }
 
 /* old broadcast_info and duplicate client_thread removed; using ChatServer APIs and broadcaster thread */
 
+/* cria a thread de leitura de um cliente já registrado no ChatServer;
+ * pending (nullable) inicia o buffer. Em erro remove o cliente. 0 se sucesso */
+static int start_reader(int client_fd, const char *pending, size_t pending_len) {
+    client_arg_t *pclient = calloc(1, sizeof(*pclient));
+    if (pclient && pending_len > 0 && (pclient->pending = malloc(pending_len))) {
+        memcpy(pclient->pending, pending, pending_len);
+        pclient->pending_len = pending_len;
+    }
+    if (!pclient || (pending_len > 0 && !pclient->pending)) {
+        tslog_write(LOG_ERROR, "Memória insuficiente ao aceitar cliente");
+        if (pclient) free(pclient->pending);
+        free(pclient);
+        chat_server_remove_client(&chat, client_fd); /* também fecha o socket */
+        return -1;
+    }
+    pclient->fd = client_fd;
 
-int main() {
-    tslog_init("server_log.txt", 1);
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        tslog_write(LOG_ERROR, "Falha ao criar socket do servidor: %s", strerror(errno));
-        tslog_close();
-        return 1;
+    /* com --cpu-io a thread já nasce fixa, sem rodar antes em outra CPU.
+     * Isso não garante a memória no nó NUMA dela: a glibc reaproveita
+     * pilhas de threads que já terminaram e a ChatConn é criada aqui */
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    int cpu = -1;
+    if (num_io_cpus > 0) {
+        cpu = io_cpus[next_io_cpu++ % (unsigned)num_io_cpus];
+        if (affinity_attr_set(&attr, cpu) != 0) cpu = -1;
+    }
+    pthread_mutex_lock(&readers_mtx);
+    readers_active++;
+    pthread_mutex_unlock(&readers_mtx);
+    pthread_t tid;
+    int rc = pthread_create(&tid, &attr, client_thread, pclient);
+    pthread_attr_destroy(&attr);
+    if (rc != 0 && cpu >= 0) {
+        /* CPU inexistente/offline: a thread roda sem fixação */
+        tslog_write(LOG_WARN, "Nao foi possivel fixar o cliente %d na CPU %d", client_fd, cpu);
+        rc = pthread_create(&tid, NULL, client_thread, pclient);
+    }
+    if (rc != 0) {
+        tslog_write(LOG_ERROR, "Falha ao criar thread para cliente %d", client_fd);
+        chat_server_remove_client(&chat, client_fd); /* também fecha o socket */
+        free(pclient->pending);
+        free(pclient);
+        reader_done();
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+/* registra o cliente no ChatServer e cria sua thread; name e pending
+ * (nullable) vêm de um handoff. 0 se sucesso */
+static int spawn_client(int client_fd, const char *name, const char *pending, size_t pending_len) {
+    if (chat_server_add_client(&chat, client_fd) != 0) {
+        tslog_write(LOG_WARN, "Limite de clientes atingido. Rejeitando fd=%d", client_fd);
+        close(client_fd);
+        return -1;
     }
+    /* o nome herdado vale antes da primeira linha lida */
+    if (name) chat_server_set_name(&chat, client_fd, name);
+    return start_reader(client_fd, pending, pending_len);
+}
 
-    server_fd_global = server_fd;
-    signal(SIGINT, sigint_handler);
+/* acorda as threads de cliente e espera todas pararem de ler; 0 ou -1 se
+ * alguma não parou em timeout_ms */
+static int stop_readers(int timeout_ms) {
+    char c = 1;
+    if (write(readers_stop_pipe[1], &c, 1) != 1) return -1;
+    readers_stopped = 1;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    int rc = 0;
+    pthread_mutex_lock(&readers_mtx);
+    while (readers_active > 0 && rc == 0) {
+        if (pthread_cond_timedwait(&readers_cond, &readers_mtx, &deadline) == ETIMEDOUT) rc = -1;
+    }
+    if (readers_active == 0) rc = 0;
+    pthread_mutex_unlock(&readers_mtx);
+    return rc;
+}
 
-    struct sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(PORT);
+/* desfaz um handoff que não se completou: espera as threads de cliente
+ * pararem, religa o broadcaster e recria as threads com as linhas
+ * incompletas que elas guardaram. 0 se voltou a atender */
+static int resume_serving(void) {
+    if (readers_stopped) {
+        pthread_mutex_lock(&readers_mtx);
+        while (readers_active > 0) pthread_cond_wait(&readers_cond, &readers_mtx);
+        pthread_mutex_unlock(&readers_mtx);
+        char c;
+        if (read(readers_stop_pipe[0], &c, 1) != 1) return -1;
+        readers_stopped = 0;
+    }
+    if (chat_server_resume(&chat) != 0) return -1;
 
-    if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        tslog_write(LOG_ERROR, "Falha no bind: %s", strerror(errno));
-        close(server_fd);
-        tslog_close();
+    handoff_state_t st = {0};
+    st.num_clients = chat_server_export_clients(&chat, &st.client_fds, &st.names,
+                                                &st.pending, &st.pending_len, &st.next_seq);
+    if (st.num_clients < 0) return -1;
+    for (int i = 0; i < st.num_clients; i++) {
+        /* a thread nova recebe as linhas incompletas; não ficam duplicadas */
+        chat_server_save_pending(&chat, st.client_fds[i], NULL, 0);
+        start_reader(st.client_fds[i], st.pending[i], st.pending_len[i]);
+    }
+    handoff_state_free(&st);
+    return 0;
+}
+
+/* entrega o socket de escuta e os clientes ao processo que conectou em
+ * handoff_fd; 0 se o novo processo assumiu, -1 se os sockets continuam
+ * com este processo (chamar resume_serving) */
+static int do_handoff(int handoff_fd, int server_fd) {
+    int conn = accept(handoff_fd, NULL, NULL);
+    if (conn < 0) {
+        tslog_write(LOG_ERROR, "Handoff: accept falhou: %s", strerror(errno));
+        return -1;
+    }
+    /* nenhuma thread pode ler dos sockets depois do export: o que ela lesse
+     * se perderia. As linhas completas já lidas ficam na fila, as
+     * incompletas em chat_server_save_pending */
+    if (stop_readers(DRAIN_TIMEOUT_MS) != 0) {
+        tslog_write(LOG_ERROR, "Handoff: threads de cliente nao pararam no prazo");
+        close(conn);
+        return -1;
+    }
+    /* entrega o que já está na fila antes de passar os sockets; os clientes
+     * continuam conectados (sem SHUT_WR). O novo processo espera até
+     * HANDOFF_WAIT_MS, que cobre este drain e o stop_readers acima */
+    if (chat_server_drain(&chat, DRAIN_TIMEOUT_MS, 0) != 0) {
+        tslog_write(LOG_WARN, "Handoff: fila não drenou no prazo");
+    }
+    handoff_state_t st = {0};
+    st.listen_fd = server_fd;
+    st.num_clients = chat_server_export_clients(&chat, &st.client_fds, &st.names,
+                                                &st.pending, &st.pending_len, &st.next_seq);
+    st.history_count = st.num_clients >= 0 ? chat_server_export_history(&chat, &st.history) : -1;
+    if (st.history_count < 0) st.history_count = 0;
+    int rc = st.num_clients >= 0 && st.history ? handoff_send(conn, &st) : -1;
+    if (rc != 0) {
+        tslog_write(LOG_ERROR, "Handoff: falha ao enviar sockets ao novo processo");
+    } else if ((rc = handoff_wait_ack(conn, HANDOFF_ACK_MS)) != 0) {
+        /* o novo processo não assumiu (caiu ou falhou ao iniciar): as
+         * cópias dos sockets que ele recebeu somem quando ele sai */
+        tslog_write(LOG_ERROR, "Handoff: novo processo nao confirmou (espera de ate %d ms)", HANDOFF_ACK_MS);
+    } else {
+        tslog_write(LOG_INFO, "Handoff: %d cliente(s), %d mensagem(ns) de historico e socket de escuta entregues (proxima seq=%lu)",
+                    st.num_clients, st.history_count, st.next_seq);
+    }
+    handoff_state_free(&st);
+    close(conn);
+    return rc;
+}
+
+/* assume os sockets recebidos de um processo anterior; o histórico vem
+ * antes de qualquer mensagem nova para o RESUME continuar funcionando */
+static void adopt_handoff(handoff_state_t *st) {
+    chat_server_import_history(&chat, st->history, st->history_count);
+    chat_server_resume_seq(&chat, st->next_seq);
+    for (int i = 0; i < st->num_clients; i++) {
+        spawn_client(st->client_fds[i], st->names[i],
+                     st->pending ? st->pending[i] : NULL, st->pending_len ? st->pending_len[i] : 0);
+    }
+    tslog_write(LOG_INFO, "Handoff: %d cliente(s) assumidos sem reconexao (%d mensagem(ns) de historico)",
+                st->num_clients, st->history_count);
+}
+
+/* grava o trace pedido por SIGUSR1 em trace_<pid>.json */
+static void dump_trace(void) {
+#ifdef CHAT_TRACE
+    char path[64];
+    snprintf(path, sizeof(path), "trace_%d.json", (int)getpid());
+    int n = trace_dump(path);
+    if (n < 0) {
+        tslog_write(LOG_ERROR, "Falha ao gravar trace em %s: %s", path, strerror(errno));
+    } else {
+        tslog_write(LOG_INFO, "Trace gravado em %s (%d eventos)", path, n);
+    }
+#else
+    tslog_write(LOG_WARN, "Dump de trace pedido, mas o servidor foi compilado sem TRACE=1");
+#endif
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Uso: %s [--port N] [--handoff CAMINHO] [--idle-timeout SEGUNDOS]\n"
+                    "          [--node-id ID --peer HOST:PORTA ... --allow-peer HOST ...]\n"
+                    "          [--log-shards PREFIXO [--log-max-mb N] [--log-max-age SEGUNDOS]]\n"
+                    "          [--cpu-broadcaster CPU] [--cpu-io LISTA (ex.: 2-5,8)]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    const char *handoff_path = NULL;
+    int idle_timeout_ms = CHAT_IDLE_TIMEOUT_MS;
+    int port = DEFAULT_PORT;
+    int node_id = 0;
+    const char *peers[CLUSTER_MAX_PEERS];
+    int num_peers = 0;
+    const char *allowed_peers[CLUSTER_MAX_PEERS];
+    int num_allowed_peers = 0;
+    const char *log_shards = NULL;
+    long log_max_mb = 0;
+    int log_max_age = 0;
+    int broadcaster_cpu = -1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cpu-broadcaster") == 0 && i + 1 < argc) {
+            broadcaster_cpu = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cpu-io") == 0 && i + 1 < argc) {
+            num_io_cpus = affinity_parse_cpus(argv[++i], io_cpus, MAX_IO_CPUS);
+            if (num_io_cpus <= 0) {
+                fprintf(stderr, "Lista de CPUs invalida: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--log-shards") == 0 && i + 1 < argc) {
+            log_shards = argv[++i];
+        } else if (strcmp(argv[i], "--log-max-mb") == 0 && i + 1 < argc) {
+            log_max_mb = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--log-max-age") == 0 && i + 1 < argc) {
+            log_max_age = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--node-id") == 0 && i + 1 < argc) {
+            node_id = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--peer") == 0 && i + 1 < argc && num_peers < CLUSTER_MAX_PEERS) {
+            peers[num_peers++] = argv[++i];
+        } else if (strcmp(argv[i], "--allow-peer") == 0 && i + 1 < argc && num_allowed_peers < CLUSTER_MAX_PEERS) {
+            allowed_peers[num_allowed_peers++] = argv[++i];
+        } else if (strcmp(argv[i], "--handoff") == 0 && i + 1 < argc) {
+            handoff_path = argv[++i];
+        } else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+            idle_timeout_ms = atoi(argv[++i]) * 1000;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if ((num_peers > 0 || num_allowed_peers > 0) && node_id <= 0) {
+        fprintf(stderr, "--peer e --allow-peer exigem --node-id (1..%d)\n", CLUSTER_MAX_NODES - 1);
         return 1;
     }
 
-    if (listen(server_fd, MAX_CLIENTS) < 0) {
-        tslog_write(LOG_ERROR, "Falha no listen: %s", strerror(errno));
-        close(server_fd);
+    if (log_shards) {
+        /* um arquivo por thread: nenhum lock compartilhado no caminho do log */
+        if (tslog_init_sharded(log_shards, (size_t)log_max_mb * 1024 * 1024, log_max_age) != 0) {
+            fprintf(stderr, "Falha ao iniciar log particionado em %s\n", log_shards);
+            return 1;
+        }
+    } else {
+        /* o processo antigo ainda está escrevendo em server_log.txt durante um handoff */
+        tslog_init("server_log.txt", handoff_path ? 0 : 1);
+    }
+
+    if (pipe(wake_pipe) != 0) {
+        tslog_write(LOG_ERROR, "Falha ao criar self-pipe: %s", strerror(errno));
         tslog_close();
         return 1;
     }
+    struct sigaction sa = {0};
+    sa.sa_handler = signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* se já existe um servidor escutando no caminho de handoff, assume os sockets dele */
+    handoff_state_t inherited = {0};
+    inherited.listen_fd = -1;
+    inherited.conn_fd = -1;
+    int took_over = 0;
+    if (handoff_path) {
+        int rc = handoff_receive(handoff_path, &inherited, HANDOFF_WAIT_MS);
+        if (rc < 0) {
+            tslog_write(LOG_ERROR, "Handoff: falha ao receber sockets de %s", handoff_path);
+            tslog_close();
+            return 1;
+        }
+        took_over = (rc == 0);
+    }
+
+    int server_fd = inherited.listen_fd;
+    if (!took_over) {
+        server_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_fd < 0) {
+            tslog_write(LOG_ERROR, "Falha ao criar socket do servidor: %s", strerror(errno));
+            tslog_close();
+            return 1;
+        }
+        int one = 1;
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+
+        if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            tslog_write(LOG_ERROR, "Falha no bind: %s", strerror(errno));
+            close(server_fd);
+            tslog_close();
+            return 1;
+        }
+
+        if (listen(server_fd, MAX_CLIENTS) < 0) {
+            tslog_write(LOG_ERROR, "Falha no listen: %s", strerror(errno));
+            close(server_fd);
+            tslog_close();
+            return 1;
+        }
+    }
+
+    int handoff_fd = -1;
+    if (handoff_path) {
+        handoff_fd = handoff_listen(handoff_path);
+        if (handoff_fd < 0) {
+            tslog_write(LOG_WARN, "Handoff: nao foi possivel escutar em %s: %s", handoff_path, strerror(errno));
+        } else if (pipe(readers_stop_pipe) != 0) {
+            tslog_write(LOG_WARN, "Handoff: pipe de parada falhou: %s", strerror(errno));
+            close(handoff_fd);
+            handoff_fd = -1;
+        }
+    }
 
     /*
      * Fluxo principal do servidor:
-     * 1. inicializar o logger e o socket de escuta
+     * 1. inicializar o logger e o socket de escuta (ou herdá-lo via handoff)
      * 2. inicializar o ChatServer (lista de clientes, fila, broadcaster)
-     * 3. loop de accept: aceitar novas conexões, registrar o cliente com
+     * 3. loop de poll: aceitar novas conexões, registrar o cliente com
      *    chat_server_add_client e criar uma thread por cliente que lê do
-     *    socket e enfileira mensagens
-     * 4. quando sinalizado, sair do loop e executar chat_server_shutdown
+     *    socket e enfileira mensagens; atender pedidos de handoff
+     * 4. quando sinalizado, sair do loop e encerrar (imediato ou com drain)
      */
-    tslog_write(LOG_INFO, "Servidor iniciado na porta %d", PORT);
+    tslog_write(LOG_INFO, "Servidor iniciado na porta %d%s", port, took_over ? " (via handoff)" : "");
     /* Mensagem no terminal para o usuário indicando como encerrar o servidor */
     printf("Servidor Iniciado, use CTRL+C para sair\n");
     fflush(stdout);
 
-    if (chat_server_init(&chat, MAX_CLIENTS, 100) != 0) {
+    if (chat_server_init(&chat, MAX_CLIENTS, 100, broadcaster_cpu) != 0) {
         tslog_write(LOG_ERROR, "Falha ao iniciar ChatServer");
         tslog_close();
         close(server_fd);
         return 1;
     }
+    chat_server_set_idle_timeout(&chat, idle_timeout_ms);
+    if (broadcaster_cpu >= 0) {
+        if (chat.broadcaster_cpu == broadcaster_cpu) {
+            tslog_write(LOG_INFO, "Broadcaster fixado na CPU %d (no NUMA %d)",
+                        broadcaster_cpu, affinity_cpu_node(broadcaster_cpu));
+        } else {
+            tslog_write(LOG_WARN, "Nao foi possivel fixar o broadcaster na CPU %d", broadcaster_cpu);
+        }
+    }
+    if (num_io_cpus > 0) {
+        tslog_write(LOG_INFO, "Threads de cliente distribuidas em %d CPU(s), a partir da CPU %d (no NUMA %d)",
+                    num_io_cpus, io_cpus[0], affinity_cpu_node(io_cpus[0]));
+    }
+    if (node_id > 0) {
+        if (cluster_init(&cluster, &chat, node_id) != 0) {
+            tslog_write(LOG_ERROR, "Falha ao iniciar cluster (no=%d)", node_id);
+            chat_server_shutdown(&chat);
+            tslog_close();
+            close(server_fd);
+            return 1;
+        }
+        cluster_enabled = 1;
+    }
+    if (took_over) {
+        /* tudo o que pode falhar na inicialização já foi feito: confirma ao
+         * processo antigo. Sem confirmação ele continua com os sockets e
+         * este processo sai sem tocá-los */
+        if (handoff_ack(&inherited) != 0) {
+            tslog_write(LOG_ERROR, "Handoff: processo antigo nao liberou os sockets");
+            tslog_close();
+            _exit(1); /* sem shutdown: os sockets continuam com o processo antigo */
+        }
+        /* antes dos peers: mensagens deles não podem consumir números de
+         * sequência antes da numeração herdada */
+        adopt_handoff(&inherited);
+        handoff_state_free(&inherited);
+    }
+    if (cluster_enabled) {
+        for (int i = 0; i < num_allowed_peers; i++) {
+            if (cluster_allow_peer(&cluster, allowed_peers[i]) != 0) {
+                tslog_write(LOG_WARN, "Nao foi possivel aceitar peers de %s", allowed_peers[i]);
+            }
+        }
+        for (int i = 0; i < num_peers; i++) {
+            char host[64];
+            const char *colon = strrchr(peers[i], ':');
+            size_t hlen = colon ? (size_t)(colon - peers[i]) : 0;
+            if (!colon || hlen == 0 || hlen >= sizeof(host)) {
+                tslog_write(LOG_WARN, "Peer invalido '%s' (esperado HOST:PORTA)", peers[i]);
+                continue;
+            }
+            memcpy(host, peers[i], hlen);
+            host[hlen] = '\0';
+            if (cluster_add_peer(&cluster, host, atoi(colon + 1)) != 0) {
+                tslog_write(LOG_WARN, "Nao foi possivel adicionar o peer %s", peers[i]);
+            }
+        }
+        tslog_write(LOG_INFO, "Modo cluster: no %d, %d peer(s) configurado(s)", node_id, num_peers);
+    }
+    int handed_off = 0;
+    while (stop_mode == STOP_NONE && !handed_off) {
+        struct pollfd pfds[3] = {
+            { server_fd, POLLIN, 0 },
+            { wake_pipe[0], POLLIN, 0 },
+            { handoff_fd, POLLIN, 0 }, /* fd -1 é ignorado pelo poll */
+        };
+        if (poll(pfds, 3, -1) < 0) {
+            if (errno == EINTR) continue; // sinal: stop_mode é checado no loop
+            tslog_write(LOG_ERROR, "Poll falhou: %s", strerror(errno));
+            break;
+        }
+        if (pfds[1].revents & POLLIN) {
+            char drain[16];
+            ssize_t r = read(wake_pipe[0], drain, sizeof(drain));
+            (void)r;
+        }
+        if (dump_requested) {
+            dump_requested = 0;
+            dump_trace();
+        }
+        if (pfds[2].revents & POLLIN) {
+            if (do_handoff(handoff_fd, server_fd) == 0) {
+                handed_off = 1;
+                break;
+            }
+            if (resume_serving() == 0) {
+                tslog_write(LOG_INFO, "Handoff: cancelado, servidor continua atendendo");
+                continue;
+            }
+            tslog_write(LOG_ERROR, "Handoff: nao foi possivel voltar a atender, encerrando");
+            stop_mode = STOP_DRAIN;
+            break;
+        }
+        if (!(pfds[0].revents & POLLIN)) continue;
 
-    while (server_running) {
         int client_fd = accept(server_fd, NULL, NULL);
         if (client_fd < 0) {
-            if (errno == EINTR) {
-                break; // interrompido por signal
-            }
+            if (errno == EINTR) continue;
             tslog_write(LOG_ERROR, "Accept falhou: %s", strerror(errno));
             continue;
         }
-
-        int *pclient = malloc(sizeof(int));
-        if (!pclient) {
-            tslog_write(LOG_ERROR, "Memória insuficiente ao aceitar cliente");
-            close(client_fd);
-            continue;
-        }
-        *pclient = client_fd;
-
-        if (chat_server_add_client(&chat, client_fd) != 0) {
-            tslog_write(LOG_WARN, "Limite de clientes atingido. Rejeitando fd=%d", client_fd);
-            free(pclient);
-            close(client_fd);
-            continue;
+        if (spawn_client(client_fd, NULL, NULL, 0) == 0) {
+            tslog_write(LOG_INFO, "Novo cliente conectado: %d", client_fd);
         }
+    }
 
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, client_thread, pclient) != 0) {
-            tslog_write(LOG_ERROR, "Falha ao criar thread para cliente %d", client_fd);
-            chat_server_remove_client(&chat, client_fd);
-            free(pclient);
-            close(client_fd);
-            continue;
-        }
-        pthread_detach(tid);
-        tslog_write(LOG_INFO, "Novo cliente conectado: %d", client_fd);
+    if (handed_off) {
+        /*
+         * Os sockets agora pertencem ao novo processo. Não chamamos
+         * chat_server_shutdown: fechar/derrubar conexões aqui afetaria o
+         * novo processo. As threads de cliente já pararam (stop_readers) e
+         * o que leram foi entregue ou exportado; sair encerra tudo sem
+         * enviar FIN (o novo processo mantém os sockets).
+         */
+        tslog_write(LOG_INFO, "Servidor encerrando apos handoff.");
+        printf("Sockets entregues ao novo processo, encerrando...\n");
+        fflush(stdout);
+        tslog_close();
+        _exit(0);
     }
-    /* main thread detected server_running == 0 or accept was interrupted */
+
+    /* main thread detected stop_mode != STOP_NONE or the loop failed */
     tslog_write(LOG_INFO, "Servidor encerrando: sinal recebido ou loop de accept finalizado.");
     /* Mensagem de encerramento no terminal */
     printf("Servidor encerrando...\n");
     fflush(stdout);
+    close(server_fd); /* para de aceitar antes de drenar */
+    if (cluster_enabled) {
+        /* para de encaminhar; o que já está na fila ainda é entregue localmente */
+        cluster_shutdown(&cluster);
+    }
+    if (handoff_fd >= 0) {
+        close(handoff_fd);
+        unlink(handoff_path);
+    }
+    if (stop_mode == STOP_DRAIN) {
+        if (chat_server_drain(&chat, DRAIN_TIMEOUT_MS, 1) == 0) {
+            tslog_write(LOG_INFO, "Drain concluido: fila e buffers de saida entregues");
+        }
+    }
     chat_server_shutdown(&chat);
     tslog_close();
-    if (server_fd >= 0) close(server_fd);
     return 0;
-}
\ No newline at end of file
+}
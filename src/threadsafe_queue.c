@@ -1,6 +1,5 @@
 #include "threadsafe_queue.h"
 #include <stdlib.h>
-#include <string.h>
 
 int mq_init(message_queue_t *q) {
     if (!q) return -1;
@@ -14,25 +13,21 @@ int mq_init(message_queue_t *q) {
     return 0;
 }
 
-int mq_push(message_queue_t *q, const char *msg, int sender) {
-    if (!q || !msg) return -1;
+int mq_push(message_queue_t *q, envelope_t *env, int sender) {
+    if (!q || !env) return -1;
     mq_item_t *it = malloc(sizeof(mq_item_t));
     if (!it) return -1;
-    /* duplicar a mensagem: a fila passa a possuir esta cópia e o chamador
-     * pode liberar seu próprio buffer independentemente. mq_pop transferirá
-     * a posse para o consumidor (que deve liberar). */
-    it->msg = strdup(msg);
-    if (!it->msg) {
-        free(it);
-        return -1;
-    }
+    /* a fila adquire sua própria referência do envelope (sem copiar os
+     * bytes): o chamador continua dono da sua. mq_pop transferirá esta
+     * referência para o consumidor (que deve chamar envelope_unref). */
+    it->env = envelope_ref(env);
     it->sender = sender;
     it->next = NULL;
 
     pthread_mutex_lock(&q->mtx); //obtem lock para modificar a fila
     if (q->closed) {
         pthread_mutex_unlock(&q->mtx);
-        free(it->msg);
+        envelope_unref(it->env);
         free(it);
         return -1;
     }
@@ -44,8 +39,8 @@ int mq_push(message_queue_t *q, const char *msg, int sender) {
     return 0;
 }
 
-int mq_pop(message_queue_t *q, char **out_msg, int *out_sender) {
-    if (!q || !out_msg || !out_sender) return -1;
+int mq_pop(message_queue_t *q, envelope_t **out_env, int *out_sender) {
+    if (!q || !out_env || !out_sender) return -1;
     pthread_mutex_lock(&q->mtx); //obtem lock para modificar a fila
     while (!q->head && !q->closed) {
         pthread_cond_wait(&q->cond, &q->mtx); //espera por nova mensagem ou fechamento
@@ -58,13 +53,30 @@ int mq_pop(message_queue_t *q, char **out_msg, int *out_sender) {
     q->head = it->next;
     if (!q->head) q->tail = NULL;
     pthread_mutex_unlock(&q->mtx); //libera o lock apos modificar a fila
-    /* transferir a posse da string para o chamador */
-    *out_msg = it->msg;
+    /* transferir a referência do envelope para o chamador */
+    *out_env = it->env;
     *out_sender = it->sender;
     free(it); //envia a copia e libera o item da fila
     return 0;
 }
 
+int mq_try_pop(message_queue_t *q, envelope_t **out_env, int *out_sender) {
+    if (!q || !out_env || !out_sender) return -1;
+    pthread_mutex_lock(&q->mtx);
+    mq_item_t *it = q->head;
+    if (!it) {
+        pthread_mutex_unlock(&q->mtx);
+        return -1; // vazia (usado para juntar itens já enfileirados num lote)
+    }
+    q->head = it->next;
+    if (!q->head) q->tail = NULL;
+    pthread_mutex_unlock(&q->mtx);
+    *out_env = it->env;
+    *out_sender = it->sender;
+    free(it);
+    return 0;
+}
+
 void mq_close(message_queue_t *q) { //fecha a fila (nenhum push futuro)
     if (!q) return;
     pthread_mutex_lock(&q->mtx);
@@ -73,13 +85,20 @@ void mq_close(message_queue_t *q) { //fecha a fila (nenhum push futuro)
     pthread_mutex_unlock(&q->mtx);
 }
 
+void mq_reopen(message_queue_t *q) {
+    if (!q) return;
+    pthread_mutex_lock(&q->mtx);
+    q->closed = 0;
+    pthread_mutex_unlock(&q->mtx);
+}
+
 void mq_destroy(message_queue_t *q) { //destroi a fila e libera recursos
     if (!q) return;
     pthread_mutex_lock(&q->mtx);
     mq_item_t *it = q->head;
     while (it) {
         mq_item_t *next = it->next;
-        free(it->msg);
+        envelope_unref(it->env);
         free(it);
         it = next;
     }
@@ -0,0 +1,83 @@
+#include "timer_wheel.h"
+#include <string.h>
+
+#define TW_MASK (TW_SLOTS - 1)
+/* maior distância representável: o que passar disso é limitado ao último nível */
+#define TW_MAX_DELTA ((1UL << (TW_LEVELS * TW_SLOT_BITS)) - 1)
+
+void tw_init(timer_wheel_t *tw, unsigned long now) {
+    memset(tw->slots, 0, sizeof(tw->slots));
+    tw->now = now;
+}
+
+void tw_timer_init(tw_timer_t *t, void *data) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->data = data;
+}
+
+/* insere no nível cuja granularidade cobre a distância até o vencimento */
+static void place(timer_wheel_t *tw, tw_timer_t *t) {
+    unsigned long delta = t->expires - tw->now;
+    if (delta > TW_MAX_DELTA) {
+        delta = TW_MAX_DELTA;
+        t->expires = tw->now + delta;
+    }
+    int level = 0;
+    while (level < TW_LEVELS - 1 && delta >= (1UL << ((level + 1) * TW_SLOT_BITS))) {
+        level++;
+    }
+    tw_timer_t **head = &tw->slots[level][(t->expires >> (level * TW_SLOT_BITS)) & TW_MASK];
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+void tw_cancel(tw_timer_t *t) {
+    if (!t->pprev) return;
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+void tw_schedule(timer_wheel_t *tw, tw_timer_t *t, unsigned long expires) {
+    tw_cancel(t);
+    /* o tick atual já foi processado */
+    t->expires = (long)(expires - tw->now) > 0 ? expires : tw->now + 1;
+    place(tw, t);
+}
+
+/* redistribui uma posição de um nível superior pelos níveis de baixo */
+static int cascade(timer_wheel_t *tw, int level) {
+    int idx = (tw->now >> (level * TW_SLOT_BITS)) & TW_MASK;
+    tw_timer_t *t = tw->slots[level][idx];
+    tw->slots[level][idx] = NULL;
+    while (t) {
+        tw_timer_t *next = t->next;
+        t->pprev = NULL;
+        place(tw, t);
+        t = next;
+    }
+    return idx;
+}
+
+void tw_advance(timer_wheel_t *tw, unsigned long now, tw_callback_t cb, void *arg) {
+    while ((long)(now - tw->now) > 0) {
+        tw->now++;
+        /* ao completar uma volta num nível, desce a próxima posição do nível acima */
+        if ((tw->now & TW_MASK) == 0) {
+            for (int level = 1; level < TW_LEVELS; level++) {
+                if (cascade(tw, level) != 0) break;
+            }
+        }
+        tw_timer_t **slot = &tw->slots[0][tw->now & TW_MASK];
+        while (*slot) {
+            tw_timer_t *t = *slot;
+            tw_cancel(t);
+            cb(t, arg);
+        }
+    }
+}
@@ -0,0 +1,197 @@
+#include "trace.h"
+
+#ifdef CHAT_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_USE_TSC 1
+#endif
+
+#define TRACE_RING_SIZE 8192 /* eventos por thread (potência de 2) */
+
+typedef struct {
+    uint64_t ts;
+    unsigned long seq;
+    int stage;
+} trace_event_t;
+
+/*
+ * Buffer de uma thread. Só a dona escreve; head é publicado com release
+ * para o dump. Buffers nunca são liberados: quando a thread termina o
+ * buffer fica marcado como livre e é reaproveitado por uma thread nova
+ * (os eventos antigos continuam lá até serem sobrescritos).
+ */
+typedef struct trace_ring {
+    trace_event_t ev[TRACE_RING_SIZE];
+    unsigned long head;
+    int tid;
+    int in_use;
+    struct trace_ring *next;
+} trace_ring_t;
+
+static trace_ring_t *rings = NULL;     /* lista global, só cresce (push com CAS) */
+static __thread trace_ring_t *my_ring = NULL;
+static __thread uint64_t pending_recv_ts = 0;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+/* referência para converter timestamps brutos em ns */
+static uint64_t base_raw;
+static struct timespec base_mono;
+
+static const char *stage_names[TRACE_STAGE_COUNT] = {
+    "recv", "enqueue", "mq_push", "mq_pop", "send_begin", "send_end"
+};
+
+static void ring_release(void *p) {
+    __atomic_store_n(&((trace_ring_t *)p)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void trace_once(void) {
+    pthread_key_create(&ring_key, ring_release);
+    clock_gettime(CLOCK_MONOTONIC, &base_mono);
+    base_raw = trace_now();
+}
+
+uint64_t trace_now(void) {
+#ifdef TRACE_USE_TSC
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static trace_ring_t *ring_get(void) {
+    if (my_ring) return my_ring;
+    pthread_once(&ring_once, trace_once);
+    /* reaproveita o buffer de uma thread que já terminou */
+    for (trace_ring_t *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&r->in_use, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            my_ring = r;
+            break;
+        }
+    }
+    if (!my_ring) {
+        trace_ring_t *r = calloc(1, sizeof(trace_ring_t));
+        if (!r) return NULL;
+        r->in_use = 1;
+        r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        my_ring = r;
+    }
+    my_ring->tid = (int)syscall(SYS_gettid);
+    pthread_setspecific(ring_key, my_ring);
+    return my_ring;
+}
+
+void trace_record(trace_stage_t stage, unsigned long seq, uint64_t ts) {
+    trace_ring_t *r = ring_get();
+    if (!r) return;
+    unsigned long h = r->head;
+    trace_event_t *e = &r->ev[h & (TRACE_RING_SIZE - 1)];
+    e->ts = ts;
+    e->seq = seq;
+    e->stage = stage;
+    __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+void trace_mark_recv(void) {
+    if (!my_ring) ring_get(); // fixa a base de tempo antes do primeiro timestamp
+    pending_recv_ts = trace_now();
+}
+
+void trace_flush_recv(unsigned long seq) {
+    if (!pending_recv_ts) return;
+    trace_record(TRACE_RECV, seq, pending_recv_ts);
+    /* consumido: uma mensagem enfileirada depois por esta thread sem novo
+     * recv (por exemplo frames de peer) não herda um horário antigo */
+    pending_recv_ts = 0;
+}
+
+typedef struct {
+    uint64_t ts;
+    unsigned long seq;
+    int stage;
+    int tid;
+} dump_event_t;
+
+static int cmp_seq_ts(const void *a, const void *b) {
+    const dump_event_t *x = a, *y = b;
+    if (x->seq != y->seq) return x->seq < y->seq ? -1 : 1;
+    return (x->ts > y->ts) - (x->ts < y->ts);
+}
+
+int trace_dump(const char *path) {
+    pthread_once(&ring_once, trace_once);
+
+    /* converte timestamps brutos para µs desde o início do trace */
+    struct timespec now_mono;
+    uint64_t now_raw = trace_now();
+    clock_gettime(CLOCK_MONOTONIC, &now_mono);
+    double elapsed_ns = (double)(now_mono.tv_sec - base_mono.tv_sec) * 1e9 +
+                        (double)(now_mono.tv_nsec - base_mono.tv_nsec);
+    double ns_per_raw = (now_raw > base_raw && elapsed_ns > 0) ? elapsed_ns / (double)(now_raw - base_raw) : 1.0;
+
+    /* cópia dos buffers: as threads continuam gravando; eventos
+     * sobrescritos durante a cópia podem sair inconsistentes (best effort) */
+    size_t cap = 0, n = 0;
+    dump_event_t *evs = NULL;
+    for (trace_ring_t *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        unsigned long count = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+        if (n + count > cap) {
+            cap = (n + count) * 2;
+            dump_event_t *bigger = realloc(evs, cap * sizeof(dump_event_t));
+            if (!bigger) { free(evs); return -1; }
+            evs = bigger;
+        }
+        for (unsigned long i = head - count; i < head; i++) {
+            trace_event_t *e = &r->ev[i & (TRACE_RING_SIZE - 1)];
+            evs[n].ts = e->ts;
+            evs[n].seq = e->seq;
+            evs[n].stage = e->stage;
+            evs[n].tid = r->tid;
+            n++;
+        }
+    }
+
+    FILE *f = fopen(path, "w");
+    if (!f) { free(evs); return -1; }
+    if (n > 0) qsort(evs, n, sizeof(dump_event_t), cmp_seq_ts);
+    int pid = (int)getpid();
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"chat server\"}}", pid);
+    for (size_t i = 0; i < n; i++) {
+        double us = (double)(int64_t)(evs[i].ts - base_raw) * ns_per_raw / 1000.0;
+        fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"seq\":%lu}}",
+                stage_names[evs[i].stage], us, pid, evs[i].tid, evs[i].seq);
+        /* uma faixa assíncrona por mensagem, do primeiro ao último estágio visto */
+        int first = (i == 0 || evs[i-1].seq != evs[i].seq);
+        int last = (i + 1 == n || evs[i+1].seq != evs[i].seq);
+        if (first) {
+            fprintf(f, ",\n{\"name\":\"msg #%lu\",\"cat\":\"msg\",\"ph\":\"b\",\"id\":%lu,\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                    evs[i].seq, evs[i].seq, us, pid, evs[i].tid);
+        }
+        if (last) {
+            fprintf(f, ",\n{\"name\":\"msg #%lu\",\"cat\":\"msg\",\"ph\":\"e\",\"id\":%lu,\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                    evs[i].seq, evs[i].seq, us, pid, evs[i].tid);
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    free(evs);
+    return (int)n;
+}
+
+#endif // CHAT_TRACE
@@ -2,10 +2,46 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
 
 static FILE *log_file = NULL;
 static pthread_mutex_t log_mutex;
 
+/*
+ * Modo particionado: cada thread escreve no seu próprio arquivo (shard),
+ * então threads diferentes nunca disputam o mesmo lock. O mutex de cada
+ * shard só é disputado com tslog_close. Quando a thread termina, o shard
+ * volta para uma lista e é reaproveitado pela próxima thread criada, o que
+ * evita um arquivo por conexão. Se o arquivo de um shard não abre, as
+ * linhas dessa thread vão para a saída compartilhada (stderr, com lock).
+ */
+#define SHARD_BUFFER_BYTES 65536
+
+typedef struct log_shard {
+    pthread_mutex_t mtx;
+    FILE *fp;
+    int id;
+    int part;                    /* número da rotação atual */
+    size_t bytes;                /* escritos na parte atual */
+    long long opened_ns;         /* CLOCK_MONOTONIC de abertura da parte */
+    int in_use;                  /* protegido por shards_mtx */
+    struct log_shard *next;      /* lista de todos os shards */
+} log_shard_t;
+
+static int sharded = 0;
+static int shards_closed = 0;   /* protegido por shards_mtx */
+static char shard_prefix[256];
+static size_t shard_max_bytes;
+static long long shard_max_age_ns;
+static pthread_key_t shard_key;
+static pthread_mutex_t shards_mtx = PTHREAD_MUTEX_INITIALIZER; /* só na entrada/saída de threads */
+static log_shard_t *all_shards = NULL;
+static int next_shard_id = 0;
+static __thread log_shard_t *my_shard = NULL;
+static int shard_open_warned = 0;  /* a falha de abertura é avisada uma vez */
+
 static const char *level_to_str(log_level_t level) { //Mensagens de Erro
     switch (level) {
         case LOG_INFO:  return "INFO";
@@ -38,20 +74,110 @@ int tslog_init(const char *filename, int overwrite) { //Inicialização do arqui
 }
 
 
+static long long mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* abre a próxima parte do shard (exige s->mtx ou shard ainda não publicado) */
+static void shard_open_part(log_shard_t *s) {
+    char path[320];
+    snprintf(path, sizeof(path), "%s.%d.%d.%d.log", shard_prefix, (int)getpid(), s->id, s->part);
+    s->fp = fopen(path, "w");
+    if (s->fp) {
+        setvbuf(s->fp, NULL, _IOFBF, SHARD_BUFFER_BYTES);
+    } else if (!__atomic_exchange_n(&shard_open_warned, 1, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "tslog: nao foi possivel abrir %s (%s); usando stderr\n", path, strerror(errno));
+    }
+    s->bytes = 0;
+    s->opened_ns = mono_ns();
+}
+
+/* destrutor da pthread_key: a thread terminou, o shard fica livre */
+static void shard_release(void *arg) {
+    log_shard_t *s = (log_shard_t *)arg;
+    pthread_mutex_lock(&s->mtx);
+    if (s->fp) fflush(s->fp);
+    pthread_mutex_unlock(&s->mtx);
+    pthread_mutex_lock(&shards_mtx);
+    s->in_use = 0;
+    pthread_mutex_unlock(&shards_mtx);
+}
+
+/* shard da thread atual: reaproveita um livre ou cria um novo */
+static log_shard_t *shard_acquire(void) {
+    pthread_mutex_lock(&shards_mtx);
+    if (shards_closed) {
+        pthread_mutex_unlock(&shards_mtx);
+        return NULL;
+    }
+    log_shard_t *s = all_shards;
+    while (s && s->in_use) s = s->next;
+    if (!s) {
+        s = calloc(1, sizeof(log_shard_t));
+        if (!s) {
+            pthread_mutex_unlock(&shards_mtx);
+            return NULL;
+        }
+        pthread_mutex_init(&s->mtx, NULL);
+        s->id = next_shard_id++;
+        shard_open_part(s);
+        s->next = all_shards;
+        all_shards = s;
+    }
+    s->in_use = 1;
+    pthread_mutex_unlock(&shards_mtx);
+    pthread_setspecific(shard_key, s);
+    my_shard = s;
+    return s;
+}
+
+int tslog_init_sharded(const char *prefix, size_t max_bytes, int max_age_s) {
+    if (!prefix || strlen(prefix) >= sizeof(shard_prefix)) return -1;
+    if (pthread_key_create(&shard_key, shard_release) != 0) {
+        perror("Erro criando chave de thread do log");
+        return -1;
+    }
+    /* saída compartilhada para shards cujo arquivo não abriu */
+    if (pthread_mutex_init(&log_mutex, NULL) != 0) {
+        perror("Erro inicializando mutex");
+        pthread_key_delete(shard_key);
+        return -1;
+    }
+    log_file = stderr;
+    snprintf(shard_prefix, sizeof(shard_prefix), "%s", prefix);
+    shard_max_bytes = max_bytes;
+    shard_max_age_ns = (long long)max_age_s * 1000000000LL;
+    sharded = 1;
+    return 0;
+}
+
+static void shard_close_all(void) {
+    pthread_mutex_lock(&shards_mtx);
+    shards_closed = 1;
+    for (log_shard_t *s = all_shards; s; s = s->next) {
+        pthread_mutex_lock(&s->mtx);
+        if (s->fp) fclose(s->fp);
+        s->fp = NULL; // threads ainda vivas passam a descartar as linhas
+        pthread_mutex_unlock(&s->mtx);
+    }
+    pthread_mutex_unlock(&shards_mtx);
+}
+
 void tslog_close(void) {
+    if (sharded) {
+        shard_close_all();
+        return;
+    }
     if (log_file && log_file != stdout && log_file != stderr) {
         fclose(log_file);
     }
     pthread_mutex_destroy(&log_mutex); //Encerramento das ferramentas de Sincronização
 }
 
-void tslog_write(log_level_t level, const char *fmt, ...) { //Escrita no log
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-
-    va_list args;
-    va_start(args, fmt);
-
+/* escrita na saída compartilhada, serializada por log_mutex */
+static void shared_write(log_level_t level, const struct tm *t, const char *fmt, va_list args) {
     pthread_mutex_lock(&log_mutex); //Obtém a trava para escrever no log
 
     fprintf(log_file, "[%02d:%02d:%02d] [%s] ",
@@ -61,6 +187,54 @@ void tslog_write(log_level_t level, const char *fmt, ...) { //Escrita no log
     fflush(log_file);
 
     pthread_mutex_unlock(&log_mutex); //Libera a trava do log
+}
+
+/* escrita no shard da thread; linhas começam com o instante monotônico em ns */
+static void shard_write(log_level_t level, const struct tm *t, const char *fmt, va_list args) {
+    log_shard_t *s = my_shard ? my_shard : shard_acquire();
+    if (!s) return;
+    long long ns = mono_ns();
+
+    pthread_mutex_lock(&s->mtx); // só disputado com tslog_close
+    if (!s->fp) {
+        /* depois do tslog_close a linha é descartada; antes, o arquivo do
+         * shard não abriu e a linha vai para a saída compartilhada */
+        pthread_mutex_unlock(&s->mtx);
+        pthread_mutex_lock(&shards_mtx);
+        int closed = shards_closed;
+        pthread_mutex_unlock(&shards_mtx);
+        if (!closed) shared_write(level, t, fmt, args);
+        return;
+    }
+    int n = fprintf(s->fp, "%lld [%02d:%02d:%02d] [%s] ",
+                    ns, t->tm_hour, t->tm_min, t->tm_sec, level_to_str(level));
+    n += vfprintf(s->fp, fmt, args);
+    fputc('\n', s->fp);
+    if (n > 0) s->bytes += (size_t)n + 1;
+    /* buffer cheio por padrão; avisos e erros vão para o disco na hora */
+    if (level == LOG_WARN || level == LOG_ERROR) fflush(s->fp);
+    if ((shard_max_bytes && s->bytes >= shard_max_bytes) ||
+        (shard_max_age_ns && ns - s->opened_ns >= shard_max_age_ns)) {
+        fclose(s->fp);
+        s->part++;
+        shard_open_part(s);
+    }
+    pthread_mutex_unlock(&s->mtx);
+}
+
+void tslog_write(log_level_t level, const char *fmt, ...) { //Escrita no log
+    time_t now = time(NULL);
+    struct tm t;
+    localtime_r(&now, &t);
+
+    va_list args;
+    va_start(args, fmt);
+
+    if (sharded) {
+        shard_write(level, &t, fmt, args);
+    } else {
+        shared_write(level, &t, fmt, args);
+    }
 
     va_end(args);
 }
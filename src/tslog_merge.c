@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * tslog_merge: junta os shards gravados com --log-shards em um único log
+ * ordenado no tempo. Cada shard já está em ordem (uma thread por vez
+ * escreve nele), então basta uma intercalação de k vias com um heap
+ * mínimo pelo instante monotônico no início de cada linha.
+ *
+ * Uso: tslog_merge [-k] [-o SAIDA] SHARD...
+ *   -k  mantém o instante em ns no início das linhas
+ */
+
+typedef struct {
+    FILE *fp;
+    char *line;
+    size_t cap;
+    ssize_t len;
+    long long ts;
+    const char *body;  /* linha sem o prefixo de ns */
+} shard_reader_t;
+
+/* lê a próxima linha; 0 se leu, -1 no fim do arquivo */
+static int reader_next(shard_reader_t *r) {
+    r->len = getline(&r->line, &r->cap, r->fp);
+    if (r->len < 0) return -1;
+    char *end;
+    errno = 0;
+    long long ts = strtoll(r->line, &end, 10);
+    if (end != r->line && *end == ' ' && errno == 0) {
+        r->ts = ts;
+        r->body = end + 1;
+    } else {
+        /* linha sem prefixo (ex.: truncada): fica com o instante da anterior */
+        r->body = r->line;
+    }
+    return 0;
+}
+
+static int reader_less(const shard_reader_t *a, const shard_reader_t *b) {
+    return a->ts < b->ts;
+}
+
+static void heap_down(shard_reader_t **heap, int n, int i) {
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < n && reader_less(heap[l], heap[m])) m = l;
+        if (r < n && reader_less(heap[r], heap[m])) m = r;
+        if (m == i) return;
+        shard_reader_t *tmp = heap[i];
+        heap[i] = heap[m];
+        heap[m] = tmp;
+        i = m;
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Uso: %s [-k] [-o SAIDA] SHARD...\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int keep_ts = 0;
+    const char *out_path = NULL;
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-'; first++) {
+        if (strcmp(argv[first], "-k") == 0) {
+            keep_ts = 1;
+        } else if (strcmp(argv[first], "-o") == 0 && first + 1 < argc) {
+            out_path = argv[++first];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    int nfiles = argc - first;
+    if (nfiles <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *out = stdout;
+    if (out_path && !(out = fopen(out_path, "w"))) {
+        perror(out_path);
+        return 1;
+    }
+
+    shard_reader_t *readers = calloc((size_t)nfiles, sizeof(shard_reader_t));
+    shard_reader_t **heap = calloc((size_t)nfiles, sizeof(shard_reader_t *));
+    if (!readers || !heap) {
+        perror("calloc");
+        return 1;
+    }
+    int n = 0, rc = 0;
+    for (int i = 0; i < nfiles; i++) {
+        shard_reader_t *r = &readers[i];
+        r->fp = fopen(argv[first + i], "r");
+        if (!r->fp) {
+            perror(argv[first + i]);
+            rc = 1;
+            continue;
+        }
+        if (reader_next(r) == 0) heap[n++] = r;
+    }
+    for (int i = n / 2 - 1; i >= 0; i--) heap_down(heap, n, i);
+
+    long long lines = 0;
+    while (n > 0) {
+        shard_reader_t *r = heap[0];
+        fputs(keep_ts ? r->line : r->body, out);
+        if (r->len > 0 && r->line[r->len - 1] != '\n') fputc('\n', out);
+        lines++;
+        if (reader_next(r) != 0) heap[0] = heap[--n];
+        heap_down(heap, n, 0);
+    }
+
+    for (int i = 0; i < nfiles; i++) {
+        if (readers[i].fp) fclose(readers[i].fp);
+        free(readers[i].line);
+    }
+    free(readers);
+    free(heap);
+    if (out != stdout) fclose(out);
+    fprintf(stderr, "%lld linhas de %d arquivo(s)\n", lines, nfiles);
+    return rc;
+}
@@ -0,0 +1,57 @@
+#!/bin/bash
+# Verifica que, com vários remetentes simultâneos, um cliente recebe as
+# mensagens com números de sequência estritamente crescentes (o RESUME e o
+# descarte de repetidas no cliente dependem disso).
+# Uso: ./test_seq_order.sh [remetentes] [mensagens por remetente]
+
+SENDERS=${1:-8}
+COUNT=${2:-3000}
+PORT=${PORT:-9350}
+ROOT="$(cd "$(dirname "$0")" && pwd)"
+WORK="$(mktemp -d)"
+cd "$WORK" || exit 1
+
+cleanup() {
+    exec 3>&- 2>/dev/null
+    kill "$SERVER_PID" 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+"$ROOT/server" --port "$PORT" > /dev/null 2>&1 &
+SERVER_PID=$!
+sleep 0.5
+
+# o receptor fica conectado até fecharmos o fifo
+mkfifo recv_in
+"$ROOT/client" receptor --port "$PORT" < recv_in > recv_out.txt 2>&1 &
+exec 3> recv_in
+sleep 0.3
+
+echo "Iniciando $SENDERS remetentes com $COUNT mensagens cada..."
+for i in $(seq 1 "$SENDERS"); do
+    "$ROOT/client" --port "$PORT" --count "$COUNT" > "sender_$i.txt" 2>&1 &
+    SENDER_PIDS="$SENDER_PIDS $!"
+done
+wait $SENDER_PIDS
+sleep 1
+exec 3>&-
+sleep 1.5
+
+EXPECTED=$((SENDERS * COUNT))
+awk -v expected="$EXPECTED" '
+    match($0, /^\[[0-9:]+\] #[0-9]+ /) {
+        split(substr($0, RSTART, RLENGTH), f, "#")
+        seq = f[2] + 0
+        if (seq <= last) { inversions++; if (inversions <= 5) print "fora de ordem: #" seq " depois de #" last }
+        last = seq
+        received++
+    }
+    END {
+        printf "Recebidas %d de %d, inversoes: %d\n", received, expected, inversions
+        exit (inversions == 0 && received == expected) ? 0 : 1
+    }' recv_out.txt
+RC=$?
+if [ $RC -eq 0 ]; then echo "OK"; else echo "FALHOU"; fi
+exit $RC
@@ -0,0 +1,50 @@
+#!/bin/bash
+# Verifica que uma linha maior que MAX_LINE (4096) é dividida sem cortar um
+# caractere UTF-8: com 4095 'a' seguidos de "ç", o byte 4096 é o primeiro
+# byte do "ç". As duas partes devem chegar aos outros clientes como
+# mensagens válidas, sem nenhuma ser descartada pela validação.
+# Uso: ./test_utf8_split.sh
+
+PORT=${PORT:-9351}
+ROOT="$(cd "$(dirname "$0")" && pwd)"
+WORK="$(mktemp -d)"
+cd "$WORK" || exit 1
+
+cleanup() {
+    exec 4>&- 5>&- 2>/dev/null
+    kill "$SERVER_PID" 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+"$ROOT/server" --port "$PORT" > /dev/null 2>&1 &
+SERVER_PID=$!
+sleep 0.5
+
+exec 5<>"/dev/tcp/127.0.0.1/$PORT" || exit 1 # receptor
+exec 4<>"/dev/tcp/127.0.0.1/$PORT" || exit 1 # remetente
+printf 'NAME:receptor\n' >&5
+printf 'NAME:remetente\n' >&4
+sleep 0.3
+
+LONG=$(head -c 4095 /dev/zero | tr '\0' a)
+printf '%s\xc3\xa7 fim\n' "$LONG" >&4
+timeout 1.5 cat <&5 > recv.txt
+timeout 0.5 cat <&4 > sender.txt
+
+FAIL=0
+if ! grep -q "remetente: ${LONG}\$" recv.txt; then
+    echo "primeira parte (4095 bytes) nao chegou inteira"
+    FAIL=1
+fi
+if ! grep -q "remetente: ç fim\$" recv.txt; then
+    echo "segunda parte nao chegou com o caractere inteiro"
+    FAIL=1
+fi
+if grep -q "descartada" sender.txt || grep -q "Linha invalida" server_log.txt; then
+    echo "parte da linha foi descartada como UTF-8 invalido"
+    FAIL=1
+fi
+if [ $FAIL -eq 0 ]; then echo "OK"; else echo "FALHOU"; fi
+exit $FAIL